@@ -0,0 +1,523 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <matryona/matryona.h>
+#include <matryona/lacing.h>
+
+using namespace std;
+using namespace matryona;
+
+// Count allocations, so we can tell how many reading a packet takes
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	++allocations;
+	if (void *p = malloc(size ? size : 1))
+		return p;
+	throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+struct Options
+{
+	size_t tracks;
+	size_t blockSize;
+	size_t clusterBlocks;
+	Lacing lacing;
+	size_t laceFrames;
+	size_t fileSize;
+	size_t repetitions;
+	const char *output;
+};
+
+typedef vector<uint8_t> Buffer;
+
+// IDs are stored without their length marker, so put it back. IDs always use
+// the shortest encoding.
+static void putId(Buffer &out, uint64_t id)
+{
+	int length = 1;
+	while (id >= (uint64_t(1) << (7*length)) - 1)
+		++length;
+	id |= uint64_t(1) << (7*length);
+	for (int i = length - 1; i >= 0; --i)
+		out.push_back(uint8_t(id >> (8*i)));
+}
+
+static void putVint(Buffer &out, uint64_t value, int length = 0)
+{
+	if (length == 0)
+	{
+		length = 1;
+		while (value >= (uint64_t(1) << (7*length)) - 1)
+			++length;
+	}
+	value |= uint64_t(1) << (7*length);
+	for (int i = length - 1; i >= 0; --i)
+		out.push_back(uint8_t(value >> (8*i)));
+}
+
+static void putElement(Buffer &out, uint64_t id, const Buffer &data)
+{
+	putId(out, id);
+	putVint(out, data.size());
+	out.insert(out.end(), data.begin(), data.end());
+}
+
+static void putUint(Buffer &out, uint64_t id, uint64_t value, int length = 0)
+{
+	if (length == 0)
+	{
+		length = 1;
+		while (length < 8 && value >> (8*length))
+			++length;
+	}
+	putId(out, id);
+	putVint(out, length);
+	for (int i = length - 1; i >= 0; --i)
+		out.push_back(uint8_t(value >> (8*i)));
+}
+
+static void putString(Buffer &out, uint64_t id, const char *value)
+{
+	putElement(out, id, Buffer(value, value + strlen(value)));
+}
+
+// A SimpleBlock of laceFrames frames (or one without lacing), filling the
+// frames with noise
+static void putBlock(Buffer &out, const Options &options, size_t track, int16_t timeOffset, bool keyframe, uint32_t &seed)
+{
+	size_t frames = options.lacing == LACING_NONE ? 1 : options.laceFrames;
+	size_t frameSize = options.blockSize / frames;
+
+	Buffer block;
+	putVint(block, track + 1);
+	block.push_back(uint8_t(timeOffset >> 8));
+	block.push_back(uint8_t(timeOffset));
+	uint8_t flags = keyframe ? 0x80 : 0;
+	switch (options.lacing)
+	{
+	case LACING_XIPH:
+		flags |= 0x02;
+		break;
+	case LACING_FIXED:
+		flags |= 0x04;
+		break;
+	case LACING_EBML:
+		flags |= 0x06;
+		break;
+	default:
+		break;
+	}
+	block.push_back(flags);
+
+	if (options.lacing != LACING_NONE)
+	{
+		block.push_back(uint8_t(frames - 1));
+		for (size_t i = 0; i + 1 < frames; ++i)
+		{
+			if (options.lacing == LACING_XIPH)
+			{
+				size_t size = frameSize;
+				for (; size >= 255; size -= 255)
+					block.push_back(255);
+				block.push_back(uint8_t(size));
+			}
+			else if (options.lacing == LACING_EBML)
+			{
+				// The first size as is, the others as (signed) differences,
+				// which are all 0
+				if (i == 0)
+					putVint(block, frameSize);
+				else
+					block.push_back(0x80 | 63);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < frames*frameSize; ++i)
+	{
+		seed = seed*1103515245 + 12345;
+		block.push_back(uint8_t(seed >> 16));
+	}
+
+	putElement(out, id::SimpleBlock, block);
+}
+
+// A WebM file with a SeekHead, Info, Tracks, Clusters with the blocks of all
+// tracks interleaved, and Cues pointing at every Cluster
+static Buffer generate(const Options &options, size_t &blocks, uint64_t &duration)
+{
+	const uint64_t frameDuration = 33;
+	size_t frames = options.lacing == LACING_NONE ? 1 : options.laceFrames;
+
+	Buffer info;
+	putUint(info, id::TimecodeScale, defaultTimecodeScale);
+	putString(info, id::MuxingApp, "matryona bench");
+	putString(info, id::WritingApp, "matryona bench");
+
+	Buffer tracks;
+	for (size_t i = 0; i < options.tracks; ++i)
+	{
+		Buffer entry;
+		putUint(entry, id::TrackNumber, i + 1);
+		putUint(entry, id::TrackUID, i + 1);
+		putUint(entry, id::TrackType, 1);
+		putString(entry, id::CodecID, "V_VP8");
+		putUint(entry, id::DefaultDuration, frameDuration*defaultTimecodeScale);
+		putElement(tracks, id::TrackEntry, entry);
+	}
+
+	// The SeekHead has fixed size positions, so we know its size up front
+	const uint64_t seekTargets[] = {id::SegmentInfo, id::Tracks, id::Cues};
+	const size_t seekHeadSize = 4 + 1 + 3*(2 + 1 + 2 + 1 + 4 + 2 + 1 + 8);
+	Buffer body(seekHeadSize);
+	uint64_t positions[3];
+
+	positions[0] = body.size();
+	putElement(body, id::SegmentInfo, info);
+	positions[1] = body.size();
+	putElement(body, id::Tracks, tracks);
+
+	Buffer cues;
+	uint32_t seed = 1;
+	uint64_t timecode = 0;
+	blocks = 0;
+	while (body.size() < options.fileSize)
+	{
+		Buffer cuePoint;
+		putUint(cuePoint, id::CueTime, timecode);
+		Buffer trackPositions;
+		putUint(trackPositions, id::CueTrack, 1);
+		putUint(trackPositions, id::CueClusterPosition, body.size());
+		putElement(cuePoint, id::CueTrackPositions, trackPositions);
+		putElement(cues, id::CuePoint, cuePoint);
+
+		Buffer cluster;
+		putUint(cluster, id::Timecode, timecode);
+		for (size_t i = 0; i < options.clusterBlocks; ++i)
+			for (size_t track = 0; track < options.tracks; ++track)
+			{
+				putBlock(cluster, options, track, int16_t(i*frames*frameDuration), i == 0, seed);
+				++blocks;
+			}
+		putElement(body, id::Cluster, cluster);
+		timecode += options.clusterBlocks*frames*frameDuration;
+	}
+	duration = timecode;
+
+	positions[2] = body.size();
+	putElement(body, id::Cues, cues);
+
+	Buffer seekHead;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		Buffer seek;
+		Buffer seekId;
+		putId(seekId, seekTargets[i]);
+		putElement(seek, id::SeekID, seekId);
+		putUint(seek, id::SeekPosition, positions[i], 8);
+		putElement(seekHead, id::Seek, seek);
+	}
+	Buffer head;
+	putElement(head, id::SeekHead, seekHead);
+	copy(head.begin(), head.end(), body.begin());
+
+	Buffer header;
+	putUint(header, id::EBMLVersion, 1);
+	putUint(header, id::EBMLReadVersion, 1);
+	putUint(header, id::EBMLMaxIDLength, 4);
+	putUint(header, id::EBMLMaxSizeLength, 8);
+	putString(header, id::DocType, "webm");
+	putUint(header, id::DocTypeVersion, 2);
+	putUint(header, id::DocTypeReadVersion, 2);
+
+	Buffer file;
+	putElement(file, id::EBML, header);
+	putId(file, id::Segment);
+	putVint(file, body.size(), 8);
+	file.insert(file.end(), body.begin(), body.end());
+	return file;
+}
+
+struct Results
+{
+	double openTime;
+	double packetsPerSecond;
+	double bytesPerSecond;
+	double seekTime;
+	double allocationsPerPacket;
+
+	// Of reading everything, if built with MATRYONA_STATS
+	IOStats io;
+	ParserStats parser;
+};
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Open the file with the kind of IO we're measuring, and a Parser on it
+struct Input
+{
+	unique_ptr<CIO> cio;
+	unique_ptr<MemIO> memIO;
+	unique_ptr<Parser> parser;
+
+	Input(const string &filename, const Buffer &file, bool memory)
+	{
+		if (memory)
+		{
+			memIO.reset(new MemIO(reinterpret_cast<const char*>(file.data()), file.size()));
+			parser.reset(new Parser(memIO.get()));
+		}
+		else
+		{
+			cio.reset(new CIO(filename.c_str()));
+			parser.reset(new Parser(cio.get()));
+		}
+	}
+};
+
+static Results measure(const Options &options, const string &filename, const Buffer &file, uint64_t duration, bool memory)
+{
+	Results results;
+
+	double start = now();
+	for (size_t i = 0; i < options.repetitions; ++i)
+		Input input(filename, file, memory);
+	results.openTime = (now() - start) / options.repetitions;
+
+	// Read all streams, one packet each in turn, like a player would
+	{
+		Input input(filename, file, memory);
+		Parser &parser = *input.parser;
+		size_t streams = parser.getNumStreams();
+		parser.setInterleaved(true, 1024);
+
+		vector<bool> done(streams, false);
+		size_t left = streams;
+		size_t packets = 0;
+		uint64_t bytes = 0;
+		size_t allocationsBefore = allocations;
+		start = now();
+		while (left)
+		{
+			for (size_t stream = 0; stream < streams; ++stream)
+			{
+				if (done[stream])
+					continue;
+
+				const uint8_t *data;
+				uint64_t size, frameDuration;
+				int64_t timestamp;
+				if (!parser.readData(stream, data, size, timestamp, frameDuration))
+				{
+					done[stream] = true;
+					--left;
+					continue;
+				}
+				++packets;
+				bytes += size;
+			}
+		}
+		double elapsed = now() - start;
+		results.packetsPerSecond = packets / elapsed;
+		results.bytesPerSecond = bytes / elapsed;
+		results.allocationsPerPacket = double(allocations - allocationsBefore) / packets;
+		results.io = input.cio ? input.cio->getIOStats() : input.memIO->getIOStats();
+		results.parser = parser.getStats();
+	}
+
+	// Seek to random times, and read the packet we land on
+	{
+		Input input(filename, file, memory);
+		Parser &parser = *input.parser;
+		uint32_t seed = 1;
+		start = now();
+		for (size_t i = 0; i < options.repetitions; ++i)
+		{
+			seed = seed*1103515245 + 12345;
+			parser.seek(0, int64_t((seed >> 8) % (duration + 1)) * defaultTimecodeScale);
+
+			const uint8_t *data;
+			uint64_t size, frameDuration;
+			int64_t timestamp;
+			parser.readData(0, data, size, timestamp, frameDuration);
+		}
+		results.seekTime = (now() - start) / options.repetitions;
+	}
+
+	return results;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("\t-t <tracks>          Number of tracks (2)\n");
+	printf("\t-b <bytes>           Block size (4096)\n");
+	printf("\t-c <blocks>          Blocks per track per Cluster (30)\n");
+	printf("\t-l <lacing>          none, xiph, ebml or fixed (none)\n");
+	printf("\t-f <frames>          Frames per laced block (4)\n");
+	printf("\t-s <megabytes>       File size (64)\n");
+	printf("\t-r <repetitions>     Opens and seeks to time (100)\n");
+	printf("\t-o <filename>        Keep the generated file here\n");
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	options.tracks = 2;
+	options.blockSize = 4096;
+	options.clusterBlocks = 30;
+	options.lacing = LACING_NONE;
+	options.laceFrames = 4;
+	options.fileSize = 64*1024*1024;
+	options.repetitions = 100;
+	options.output = nullptr;
+
+	int option;
+	while ((option = getopt(argc, argv, "t:b:c:l:f:s:r:o:h")) != -1)
+	{
+		switch (option)
+		{
+		case 't':
+			options.tracks = strtoul(optarg, nullptr, 10);
+			break;
+		case 'b':
+			options.blockSize = strtoul(optarg, nullptr, 10);
+			break;
+		case 'c':
+			options.clusterBlocks = strtoul(optarg, nullptr, 10);
+			break;
+		case 'l':
+			if (strcmp(optarg, "none") == 0)
+				options.lacing = LACING_NONE;
+			else if (strcmp(optarg, "xiph") == 0)
+				options.lacing = LACING_XIPH;
+			else if (strcmp(optarg, "ebml") == 0)
+				options.lacing = LACING_EBML;
+			else if (strcmp(optarg, "fixed") == 0)
+				options.lacing = LACING_FIXED;
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			options.laceFrames = strtoul(optarg, nullptr, 10);
+			break;
+		case 's':
+			options.fileSize = strtoul(optarg, nullptr, 10)*1024*1024;
+			break;
+		case 'r':
+			options.repetitions = strtoul(optarg, nullptr, 10);
+			break;
+		case 'o':
+			options.output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return option == 'h' ? 0 : 1;
+		}
+	}
+
+	// Block time offsets are 16 bit, and lace counts 8 bit
+	size_t frames = options.lacing == LACING_NONE ? 1 : options.laceFrames;
+	if (options.tracks < 1 || options.tracks > 126 || options.blockSize < frames ||
+			frames < 1 || frames > 256 || options.clusterBlocks < 1 ||
+			options.clusterBlocks*frames*33 > 32767 || options.repetitions < 1)
+	{
+		fprintf(stderr, "Invalid options\n");
+		return 1;
+	}
+
+	size_t blocks;
+	uint64_t duration;
+	Buffer file = generate(options, blocks, duration);
+
+	string filename;
+	if (options.output)
+		filename = options.output;
+	else
+	{
+		char path[] = "/tmp/matryona-bench-XXXXXX";
+		int fd = mkstemp(path);
+		if (fd == -1)
+		{
+			perror("mkstemp");
+			return 1;
+		}
+		close(fd);
+		filename = path;
+	}
+
+	FILE *out = fopen(filename.c_str(), "wb");
+	if (!out || fwrite(file.data(), 1, file.size(), out) != file.size() || fclose(out) != 0)
+	{
+		perror(filename.c_str());
+		return 1;
+	}
+
+	static const char *lacingNames[] = {"none", "ebml", "xiph", "fixed"};
+	printf("%.1f MB, %zu tracks, %zu blocks of %zu bytes, %zu per track per Cluster, lacing %s\n",
+		file.size() / (1024.0*1024.0), options.tracks, blocks, options.blockSize,
+		options.clusterBlocks, lacingNames[options.lacing]);
+	printf("%-6s %10s %12s %10s %10s %14s\n", "", "open us", "packets/s", "MB/s", "seek us", "allocs/packet");
+
+	int status = 0;
+	const char *names[] = {"CIO", "MemIO"};
+	Results results[2];
+	for (int memory = 0; memory < 2; ++memory)
+	{
+		try
+		{
+			results[memory] = measure(options, filename, file, duration, memory);
+			printf("%-6s %10.1f %12.0f %10.1f %10.1f %14.3f\n", names[memory],
+				results[memory].openTime*1e6, results[memory].packetsPerSecond,
+				results[memory].bytesPerSecond / (1024.0*1024.0), results[memory].seekTime*1e6,
+				results[memory].allocationsPerPacket);
+		}
+		catch (exception &e)
+		{
+			fprintf(stderr, "%s: %s\n", names[memory], e.what());
+			status = 1;
+		}
+	}
+
+	if (statsEnabled && status == 0)
+	{
+		printf("\nReading everything:\n");
+		printf("%-6s %10s %12s %12s %10s %10s %10s %10s\n", "", "reads", "MB read",
+			"MB out", "seeks", "headers", "skipped", "buffers");
+		for (int memory = 0; memory < 2; ++memory)
+		{
+			const IOStats &io = results[memory].io;
+			const ParserStats &parser = results[memory].parser;
+			printf("%-6s %10llu %12.1f %12.1f %10llu %10llu %10llu %10llu\n", names[memory],
+				(unsigned long long)io.reads, io.bytesRead / (1024.0*1024.0),
+				parser.bytesDelivered / (1024.0*1024.0), (unsigned long long)io.seeks,
+				(unsigned long long)io.elementHeaders, (unsigned long long)parser.blocksSkipped,
+				(unsigned long long)parser.bufferAllocations);
+		}
+	}
+
+	if (!options.output)
+		unlink(filename.c_str());
+	return status;
+}
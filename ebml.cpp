@@ -6,27 +6,81 @@ namespace matryona
 {
 
 EBMLElement::EBMLElement()
+	: id(0)
+	, size(0)
+	, offset(0)
+	, sizeUnknown(false)
 {
 }
 
 EBMLElement::EBMLElement(IO *parent)
+	: EBMLElement(parent, parent->tell())
 {
-	id = readVint(parent);
-	size = readVint(parent);
-	io.init(parent, size);
+	parent->seek(offset);
+}
+
+EBMLElement::EBMLElement(IO *parent, size_t start)
+{
+	// An element header is at most two 8-byte vints. If the parent has them in
+	// memory we decode them in place, otherwise we read them in one go.
+	size_t available = 0;
+	const uint8_t *header = reinterpret_cast<const uint8_t*>(parent->view(start, available));
+	uint8_t buffer[16];
+	if (!header)
+	{
+		available = parent->readAt(start, reinterpret_cast<char*>(buffer), sizeof(buffer));
+		header = buffer;
+	}
+
+	uint8_t idLength = decodeVint(header, available, id);
+	uint8_t sizeLength = idLength ? decodeVint(header + idLength, available - idLength, size) : 0;
+	if (sizeLength == 0)
+		throw IOError();
+
+	offset = start + idLength + sizeLength;
+	if (statsEnabled)
+		parent->countElementHeader();
+
+	// All ones means the size is unknown, until we find where it ends
+	sizeUnknown = size == (uint64_t(1) << (7*sizeLength)) - 1;
+	if (sizeUnknown)
+	{
+		if (offset > parent->getLength())
+			throw IOError();
+		size = parent->getLength() - offset;
+	}
+
+	io.init(parent, offset, size);
 }
 
 EBMLElementIterator::EBMLElementIterator()
 	: io(nullptr)
+	, start(0)
 	, pos(0)
 	, isValid(false)
+	, unknownParent(0)
+	, nextKnown(true)
 {
 }
 
-EBMLElementIterator::EBMLElementIterator(IO *io)
+EBMLElementIterator::EBMLElementIterator(IO *io, size_t position)
 	: io(io)
-	, pos(0)
+	, start(position)
+	, pos(position)
 	, isValid(true)
+	, unknownParent(0)
+	, nextKnown(true)
+{
+	++(*this);
+}
+
+EBMLElementIterator::EBMLElementIterator(EBMLElement &parent, size_t position)
+	: io(&parent.io)
+	, start(position)
+	, pos(position)
+	, isValid(true)
+	, unknownParent(parent.sizeUnknown ? parent.id : 0)
+	, nextKnown(true)
 {
 	++(*this);
 }
@@ -46,18 +100,31 @@ EBMLElementIterator &EBMLElementIterator::operator++()
 	if (!isValid)
 		return *this;
 
-	size_t oldPos = io->tell();
-	if (!io->seek(pos))
+	// If we don't know where the current element ends, walk it to find out
+	if (!nextKnown)
+	{
+		EBMLElementIterator child(current);
+		while (child != end)
+			++child;
+		pos = current.offset + child.getPosition();
+	}
+
+	start = pos;
+	if (pos >= io->getLength())
 	{
 		isValid = false;
 		return *this;
 	}
 
-	current = EBMLElement(io);
-	pos = io->tell() + current.size;
-
-	io->seek(oldPos);
+	current = EBMLElement(io, pos);
+	if (unknownParent && endsUnknownSize(unknownParent, current.id))
+	{
+		isValid = false;
+		return *this;
+	}
 
+	pos = current.offset + current.size;
+	nextKnown = !current.sizeUnknown;
 	return *this;
 }
 
@@ -97,6 +164,28 @@ EBMLElementIterator &EBMLElementIterator::until(uint64_t id1, uint64_t id2)
 	}
 }
 
+size_t EBMLElementIterator::getPosition() const
+{
+	return start;
+}
+
+void EBMLElementIterator::setNext(size_t position)
+{
+	pos = position;
+	nextKnown = true;
+}
+
+bool endsUnknownSize(uint64_t parent, uint64_t element)
+{
+	if (element == id::EBML)
+		return true;
+	if (parent != id::Cluster)
+		return false;
+
+	size_t i = findSchema(element);
+	return i < schemaSize && schema[i].parent == id::Segment;
+}
+
 EBMLElementIterator EBMLElementIterator::end;
 
 }
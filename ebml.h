@@ -11,17 +11,32 @@ namespace matryona
 struct EBMLElement
 {
 	EBMLElement();
+	// Read the element at the IO's position, and move past its header
 	EBMLElement(IO *io);
+	// Read the element at position, leaving the IO's own position alone
+	EBMLElement(IO *io, std::size_t position);
 
 	uint64_t id;
 	uint64_t size;
+	// Where the element's data starts in its parent
+	std::size_t offset;
 	IOWindow io;
+
+	// Live recordings can leave the size of a Segment or Cluster unknown.
+	// Then size and io cover all of the parent after it, and iterating over
+	// it stops where it ends.
+	bool sizeUnknown;
 };
 
+// Iterators only read at their own position, so several of them can walk the
+// same IO at once, as long as the IO's readAt allows it
 class EBMLElementIterator
 {
 public:
-	EBMLElementIterator(IO *io);
+	EBMLElementIterator(IO *io, std::size_t position = 0);
+	// Iterate over the children of an element, which stops at the end of
+	// elements of unknown size too
+	EBMLElementIterator(EBMLElement &parent, std::size_t position = 0);
 	EBMLElement &operator*();
 	EBMLElement *operator->();
 	EBMLElementIterator &operator++();
@@ -30,13 +45,27 @@ public:
 	EBMLElementIterator &until(uint64_t id);
 	EBMLElementIterator &until(uint64_t id1, uint64_t id2);
 
+	// Where the current element starts in the IO, or where we ended
+	std::size_t getPosition() const;
+
+	// Where the element after the current one starts, for when the current
+	// one's size is unknown, but its end was found some other way. Otherwise
+	// we walk it to find it.
+	void setNext(std::size_t position);
+
 	static EBMLElementIterator end;
 private:
 	IO *io;
+	size_t start;
 	size_t pos;
 	bool isValid;
 	EBMLElement current;
 
+	// The parent's ID if its size is unknown, or 0
+	uint64_t unknownParent;
+	// Whether pos is known, which it isn't after an element of unknown size
+	bool nextKnown;
+
 	EBMLElementIterator();
 };
 
@@ -54,6 +83,10 @@ namespace id
 	const uint64_t CRC32 = 0x3F;
 	const uint64_t Segment = 0x8538067;
 	const uint64_t SegmentInfo = 0x549A966;
+	const uint64_t TimecodeScale = 0xAD7B1;
+	const uint64_t Duration = 0x489;
+	const uint64_t MuxingApp = 0xD80;
+	const uint64_t WritingApp = 0x1741;
 	const uint64_t SeekHead = 0x14D9B74;
 	const uint64_t Cluster = 0xF43B675;
 	const uint64_t Tracks = 0x654AE6B;
@@ -77,7 +110,212 @@ namespace id
 	const uint64_t DefaultDuration = 0x3E383;
 	const uint64_t TrackTimecodeScale = 0x3314F;
 	const uint64_t BlockDuration = 0x1B;
+	const uint64_t ReferenceBlock = 0x7B;
 	const uint64_t CodecPrivate = 0x23A2;
+	const uint64_t Seek = 0xDBB;
+	const uint64_t SeekID = 0x13AB;
+	const uint64_t SeekPosition = 0x13AC;
+	const uint64_t CuePoint = 0x3B;
+	const uint64_t CueTime = 0x33;
+	const uint64_t CueTrackPositions = 0x37;
+	const uint64_t CueTrack = 0x77;
+	const uint64_t CueClusterPosition = 0x71;
 } // id
 
+// What an element holds
+enum ElementType
+{
+	TYPE_MASTER,
+	TYPE_UINT,
+	TYPE_INT,
+	TYPE_FLOAT,
+	TYPE_STRING,
+	TYPE_BINARY
+};
+
+struct ElementSchema
+{
+	uint64_t id;
+	// The element it is in, 0 for the top level
+	uint64_t parent;
+	ElementType type;
+	// Whether we can't do without it, and whether it can be there more than
+	// once. Elements the spec gives a default are not required.
+	bool required;
+	bool multiple;
+};
+
+// The Matroska elements we know of. Void and CRC32 can be in anything, so
+// they are not listed, just like the elements we never look at.
+constexpr ElementSchema schema[] =
+{
+	{id::EBML, 0, TYPE_MASTER, true, true},
+	{id::EBMLVersion, id::EBML, TYPE_UINT, false, false},
+	{id::EBMLReadVersion, id::EBML, TYPE_UINT, true, false},
+	{id::EBMLMaxIDLength, id::EBML, TYPE_UINT, false, false},
+	{id::EBMLMaxSizeLength, id::EBML, TYPE_UINT, false, false},
+	{id::DocType, id::EBML, TYPE_STRING, true, false},
+	{id::DocTypeVersion, id::EBML, TYPE_UINT, false, false},
+	{id::DocTypeReadVersion, id::EBML, TYPE_UINT, false, false},
+
+	{id::Segment, 0, TYPE_MASTER, true, true},
+	{id::SeekHead, id::Segment, TYPE_MASTER, false, true},
+	{id::SegmentInfo, id::Segment, TYPE_MASTER, true, false},
+	{id::Tracks, id::Segment, TYPE_MASTER, true, false},
+	{id::Cues, id::Segment, TYPE_MASTER, false, false},
+	{id::Cluster, id::Segment, TYPE_MASTER, false, true},
+	{id::Attachments, id::Segment, TYPE_MASTER, false, false},
+	{id::Chapters, id::Segment, TYPE_MASTER, false, false},
+	{id::Tags, id::Segment, TYPE_MASTER, false, true},
+
+	{id::TimecodeScale, id::SegmentInfo, TYPE_UINT, false, false},
+	{id::Duration, id::SegmentInfo, TYPE_FLOAT, false, false},
+	{id::MuxingApp, id::SegmentInfo, TYPE_STRING, true, false},
+	{id::WritingApp, id::SegmentInfo, TYPE_STRING, true, false},
+
+	{id::Seek, id::SeekHead, TYPE_MASTER, true, true},
+	{id::SeekID, id::Seek, TYPE_BINARY, true, false},
+	{id::SeekPosition, id::Seek, TYPE_UINT, true, false},
+
+	{id::TrackEntry, id::Tracks, TYPE_MASTER, true, true},
+	{id::TrackNumber, id::TrackEntry, TYPE_UINT, true, false},
+	{id::TrackUID, id::TrackEntry, TYPE_UINT, true, false},
+	{id::TrackType, id::TrackEntry, TYPE_UINT, true, false},
+	{id::FlagEnabled, id::TrackEntry, TYPE_UINT, false, false},
+	{id::FlagDefault, id::TrackEntry, TYPE_UINT, false, false},
+	{id::FlagLacing, id::TrackEntry, TYPE_UINT, false, false},
+	{id::DefaultDuration, id::TrackEntry, TYPE_UINT, false, false},
+	{id::TrackTimecodeScale, id::TrackEntry, TYPE_FLOAT, false, false},
+	{id::CodecID, id::TrackEntry, TYPE_STRING, true, false},
+	{id::CodecPrivate, id::TrackEntry, TYPE_BINARY, false, false},
+	{id::CodecName, id::TrackEntry, TYPE_STRING, false, false},
+
+	{id::Timecode, id::Cluster, TYPE_UINT, true, false},
+	{id::SimpleBlock, id::Cluster, TYPE_BINARY, false, true},
+	{id::BlockGroup, id::Cluster, TYPE_MASTER, false, true},
+	{id::Block, id::BlockGroup, TYPE_BINARY, true, false},
+	{id::BlockDuration, id::BlockGroup, TYPE_UINT, false, false},
+	{id::ReferenceBlock, id::BlockGroup, TYPE_INT, false, true},
+
+	{id::CuePoint, id::Cues, TYPE_MASTER, true, true},
+	{id::CueTime, id::CuePoint, TYPE_UINT, true, false},
+	{id::CueTrackPositions, id::CuePoint, TYPE_MASTER, true, true},
+	{id::CueTrack, id::CueTrackPositions, TYPE_UINT, true, false},
+	{id::CueClusterPosition, id::CueTrackPositions, TYPE_UINT, true, false},
+};
+
+constexpr std::size_t schemaSize = sizeof(schema) / sizeof(schema[0]);
+
+// Where an element is in the schema, or schemaSize if it's not there
+constexpr std::size_t findSchema(uint64_t id, std::size_t i = 0)
+{
+	return i == schemaSize || schema[i].id == id ? i : findSchema(id, i + 1);
+}
+
+// The schema of an element, which has to be in it. At compile time, asking
+// for one that isn't fails to compile.
+constexpr const ElementSchema &schemaOf(uint64_t id)
+{
+	return findSchema(id) < schemaSize ? schema[findSchema(id)] :
+		throw InvalidFileFormatError("Unknown element");
+}
+
+// What to do with a child element, for visitChildren. type is what the
+// handler reads it as, which has to match the schema.
+template <typename T>
+struct ElementHandler
+{
+	uint64_t id;
+	ElementType type;
+	bool required;
+	bool multiple;
+	void (*handle)(T &target, EBMLElement &element);
+};
+
+template <typename T>
+constexpr ElementHandler<T> handler(uint64_t id, ElementType type, void (*handle)(T &, EBMLElement &))
+{
+	return ElementHandler<T>{id, type, schemaOf(id).required, schemaOf(id).multiple, handle};
+}
+
+// Handlers that store the value of an element in a member of the target
+template <typename T, uint64_t T::*member>
+void readUintField(T &target, EBMLElement &element)
+{
+	target.*member = readUint(element.size, &element.io);
+}
+
+template <typename T, bool T::*member>
+void readFlagField(T &target, EBMLElement &element)
+{
+	target.*member = readUint(element.size, &element.io) == 1;
+}
+
+template <typename T, float T::*member>
+void readFloatField(T &target, EBMLElement &element)
+{
+	target.*member = readFloat(element.size, &element.io);
+}
+
+template <typename T, uint64_t T::*member>
+constexpr ElementHandler<T> uintField(uint64_t id)
+{
+	return handler<T>(id, TYPE_UINT, readUintField<T, member>);
+}
+
+template <typename T, bool T::*member>
+constexpr ElementHandler<T> flagField(uint64_t id)
+{
+	return handler<T>(id, TYPE_UINT, readFlagField<T, member>);
+}
+
+template <typename T, float T::*member>
+constexpr ElementHandler<T> floatField(uint64_t id)
+{
+	return handler<T>(id, TYPE_FLOAT, readFloatField<T, member>);
+}
+
+// Whether handlers only handle children of parent, and read them as what
+// they are. Meant for static_asserts on handler tables.
+template <typename T, std::size_t N>
+constexpr bool matchesSchema(const ElementHandler<T> (&handlers)[N], uint64_t parent, std::size_t i = 0)
+{
+	return i == N || (schemaOf(handlers[i].id).parent == parent &&
+		schemaOf(handlers[i].id).type == handlers[i].type &&
+		matchesSchema(handlers, parent, i + 1));
+}
+
+// Go over the children of a master element once, handing each to the handler
+// for its ID. Children without one are skipped, and children that can only be
+// there once are only handled the first time. Throws an
+// InvalidFileFormatError if a required child is missing.
+template <typename T, std::size_t N>
+void visitChildren(IO *parent, T &target, const ElementHandler<T> (&handlers)[N])
+{
+	static_assert(N <= 64, "Too many handlers");
+	uint64_t seen = 0;
+	for (EBMLElementIterator it(parent); it != EBMLElementIterator::end; ++it)
+	{
+		for (std::size_t i = 0; i < N; ++i)
+		{
+			if (handlers[i].id != it->id)
+				continue;
+
+			uint64_t bit = uint64_t(1) << i;
+			if (!(seen & bit) || handlers[i].multiple)
+				handlers[i].handle(target, *it);
+			seen |= bit;
+			break;
+		}
+	}
+
+	for (std::size_t i = 0; i < N; ++i)
+		if (handlers[i].required && !(seen & (uint64_t(1) << i)))
+			throw InvalidFileFormatError("Missing required element");
+}
+
+// Whether an element of unknown size ends where element starts. A new EBML
+// header ends anything, a Cluster ends at the next element of the Segment.
+bool endsUnknownSize(uint64_t parent, uint64_t element);
+
 } // matryona
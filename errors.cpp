@@ -4,6 +4,7 @@
 #include "errors.h"
 
 using std::size_t;
+using std::uint64_t;
 
 namespace matryona
 {
@@ -23,4 +24,14 @@ const char *InvalidFileFormatError::what() const noexcept
 	return message;
 }
 
+QueueFullError::QueueFullError(uint64_t stream)
+	: stream(stream)
+{
+}
+
+const char *QueueFullError::what() const noexcept
+{
+	return "Packet queue is full, read from the blocked stream first.";
+}
+
 } // matryona
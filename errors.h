@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <stdexcept>
 
 namespace matryona
@@ -22,5 +23,14 @@ struct InvalidFileFormatError : public ParseError
 	const char *message;
 };
 
+// Thrown in interleaved mode when a block cannot be queued, because the
+// queue for its stream is full. Read from that stream, then try again.
+struct QueueFullError : public std::exception
+{
+	QueueFullError(std::uint64_t stream);
+	const char *what() const noexcept;
+	std::uint64_t stream;
+};
+
 } // matryona
 
@@ -1,11 +1,50 @@
+#include <algorithm>
 #include <stdexcept>
+#include <cerrno>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "io.h"
 
 namespace matryona
 {
 
+size_t IO::readAt(size_t position, char *buffer, size_t length)
+{
+	if (!seek(position))
+		return 0;
+	return read(buffer, length);
+}
+
+const char *IO::view(size_t, size_t &)
+{
+	return nullptr;
+}
+
+int IO::getFileDescriptor()
+{
+	return -1;
+}
+
+IOStats IO::getIOStats() const
+{
+	IOStats stats;
+	stats.reads = reads.get();
+	stats.bytesRead = bytesRead.get();
+	stats.seeks = seeks.get();
+	stats.elementHeaders = elementHeaders.get();
+	return stats;
+}
+
+void IO::countElementHeader()
+{
+	elementHeaders.add();
+}
+
 IOWindow::IOWindow()
 	: parent(nullptr)
 	, start(0)
@@ -16,34 +55,46 @@ IOWindow::IOWindow()
 
 void IOWindow::init(IO *parent, size_t start, size_t length)
 {
+	if (start+length > parent->getLength())
+		throw IOError();
+
+	// A window into a window maps straight onto the parent's parent, so
+	// reads go to the root IO directly, however deep we're nested
+	IOWindow *window = dynamic_cast<IOWindow*>(parent);
+	if (window)
+	{
+		parent = window->parent;
+		start += window->start;
+	}
+
 	this->parent = parent;
 	this->start = start;
 	this->length = length;
-	if (start+length > parent->getLength())
-		throw IOError();
+	pos = 0;
 }
 
 void IOWindow::init(IO *parent, size_t length)
 {
-	this->parent = parent;
-	this->length = length;
-	start = parent->tell();
-	if (start+length > parent->getLength())
-		throw IOError();
+	init(parent, parent->tell(), length);
 }
 
 size_t IOWindow::read(char *buffer, size_t length)
 {
-	parent->seek(start+pos);
-
-	if (pos+length > this->length)
-		length = this->length - pos;
-
-	size_t read = parent->read(buffer, length);
+	size_t read = readAt(pos, buffer, length);
 	pos += read;
 	return read;
 }
 
+size_t IOWindow::readAt(size_t position, char *buffer, size_t length)
+{
+	if (position >= this->length)
+		return 0;
+	if (position+length > this->length)
+		length = this->length - position;
+
+	return parent->readAt(start+position, buffer, length);
+}
+
 bool IOWindow::seek(size_t position)
 {
 	if (position >= length)
@@ -62,47 +113,59 @@ size_t IOWindow::getLength()
 	return length;
 }
 
+void IOWindow::countElementHeader()
+{
+	parent->countElementHeader();
+}
+
+const char *IOWindow::view(size_t position, size_t &available)
+{
+	if (position >= length)
+		return nullptr;
+
+	const char *data = parent->view(start+position, available);
+	if (data && available > length - position)
+		available = length - position;
+	return data;
+}
+
 uint8_t readVintLength(IO *io)
 {
 	uint8_t value;
 	if (io->read(reinterpret_cast<char*>(&value), 1) != 1)
 		throw IOError();
 
-	// One leading zero, followed by a one means two bytes
-	// Two zeroes, one one means 3 bytes
-	// So count the zeroes, add one
-	uint8_t length = 1;
-	while (length <= 8 && value >> (8-length) == 0)
-		++length;
+	uint8_t length = vintLength(value);
+	if (length == 0)
+		throw IOError();
 	return length;
 }
 
-uint64_t readVint(IO *io)
+// Read the first byte to find the length, then the rest after it, and decode
+// the whole thing from memory
+static uint64_t readVint(IO *io, uint8_t &length)
 {
-	// Determine the length
-	uint8_t length;
-	{
-		size_t pos = io->tell();
-		length = readVintLength(io);
-		io->seek(pos);
-	}
-
-	// Read the file
-	char buffer[8];
-	if (io->read(buffer, length) != length)
+	uint8_t buffer[8];
+	if (io->read(reinterpret_cast<char*>(buffer), 1) != 1)
 		throw IOError();
 
-	// Read the first byte, and remove the leading 1
-	uint64_t value = static_cast<uint8_t>(buffer[0]);
-	value &= (0xFF >> length);
-
-	// Read the rest, in big endian format
-	for (uint8_t i = 1; i < length; ++i)
-		value = (value << 8) | static_cast<uint8_t>(buffer[i]);
+	length = vintLength(buffer[0]);
+	if (length == 0)
+		throw IOError();
+	if (io->read(reinterpret_cast<char*>(buffer + 1), length - 1) != size_t(length - 1))
+		throw IOError();
 
+	uint64_t value = 0;
+	decodeVint(buffer, length, value);
 	return value;
 }
 
+uint64_t readVint(IO *io)
+{
+	uint8_t length;
+	return readVint(io, length);
+}
+
 int64_t readSVint(IO *io)
 {
 	// This is the list of values to subtract for a given length. No magic here.
@@ -112,10 +175,8 @@ int64_t readSVint(IO *io)
 		0x00FFFFFFFFFFFF, 0x007FFFFFFFFFFFFF,
 	};
 
-	size_t pos = io->tell();
-	uint8_t length = readVintLength(io);
-	io->seek(pos);
-	uint64_t vint = readVint(io);
+	uint8_t length;
+	uint64_t vint = readVint(io, length);
 	return int64_t(vint)-subtr[length-1];
 }
 
@@ -125,6 +186,15 @@ CIO::CIO(const char *filename)
 	f = std::fopen(filename, "r");
 	if (!f)
 		throw std::runtime_error("Could not open file");
+
+	// Get the length up front, so getLength doesn't have to move our position
+	struct stat info;
+	if (fstat(fileno(f), &info) != 0)
+	{
+		std::fclose(f);
+		throw std::runtime_error("Could not open file");
+	}
+	length = info.st_size;
 }
 
 CIO::~CIO()
@@ -134,11 +204,14 @@ CIO::~CIO()
 
 size_t CIO::read(char *buffer, size_t length)
 {
-	return std::fread(buffer, 1, length, f);
+	size_t read = std::fread(buffer, 1, length, f);
+	countRead(read);
+	return read;
 }
 
 bool CIO::seek(size_t position)
 {
+	countSeek();
 	return std::fseek(f, position, SEEK_SET) == 0;
 }
 
@@ -149,14 +222,117 @@ size_t CIO::tell()
 
 size_t CIO::getLength()
 {
-	if (!length)
+	return length;
+}
+
+size_t CIO::readAt(size_t position, char *buffer, size_t length)
+{
+	// pread leaves the file position alone, so it doesn't disturb fread
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t result = pread(fileno(f), buffer + done, length - done, position + done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		done += result;
+	}
+
+	countRead(done);
+	return done;
+}
+
+int CIO::getFileDescriptor()
+{
+	return fileno(f);
+}
+
+BufferedIO::BufferedIO(IO *parent, size_t blockSize)
+	: parent(parent)
+	, parentPos(parent->tell())
+	, length(parent->getLength())
+	, pos(parentPos)
+	, buffer(new char[std::max<size_t>(blockSize, 1)])
+	, blockSize(std::max<size_t>(blockSize, 1))
+	, bufferStart(0)
+	, bufferLength(0)
+{
+}
+
+BufferedIO::~BufferedIO()
+{
+	delete[] buffer;
+}
+
+size_t BufferedIO::readParent(size_t position, char *buffer, size_t length)
+{
+	// Only seek if we're not there already
+	if (position != parentPos && !parent->seek(position))
+		return 0;
+
+	size_t read = parent->read(buffer, length);
+	parentPos = position + read;
+	return read;
+}
+
+size_t BufferedIO::read(char *buffer, size_t length)
+{
+	if (pos + length > this->length)
+		length = this->length - pos;
+
+	size_t done = 0;
+	while (done < length)
 	{
-		size_t old = std::ftell(f);
-		std::fseek(f, 0, SEEK_END);
-		length = std::ftell(f);
-		std::fseek(f, old, SEEK_SET);
+		// Serve what we can from our buffer
+		if (pos >= bufferStart && pos < bufferStart + bufferLength)
+		{
+			size_t amount = std::min(length - done, bufferStart + bufferLength - pos);
+			std::memcpy(buffer + done, this->buffer + pos - bufferStart, amount);
+			done += amount;
+			pos += amount;
+			continue;
+		}
+
+		// Whole blocks are not worth buffering, read those directly
+		size_t remaining = length - done;
+		if (remaining >= blockSize)
+		{
+			size_t read = readParent(pos, buffer + done, remaining - remaining % blockSize);
+			done += read;
+			pos += read;
+			if (read == 0)
+				break;
+			continue;
+		}
+
+		// Otherwise read ahead the block we're in
+		bufferStart = pos - pos % blockSize;
+		bufferLength = readParent(bufferStart, this->buffer, blockSize);
+		if (pos >= bufferStart + bufferLength)
+			break;
 	}
 
+	countRead(done);
+	return done;
+}
+
+bool BufferedIO::seek(size_t position)
+{
+	countSeek();
+	if (position >= length)
+		return false;
+	pos = position;
+	return true;
+}
+
+size_t BufferedIO::tell()
+{
+	return pos;
+}
+
+size_t BufferedIO::getLength()
+{
 	return length;
 }
 
@@ -174,11 +350,13 @@ size_t MemIO::read(char *buffer, size_t length)
 
 	std::memcpy(buffer, this->buffer+pos, length);
 	pos += length;
+	countRead(length);
 	return length;
 }
 
 bool MemIO::seek(size_t position)
 {
+	countSeek();
 	if (position >= length)
 		return false;
 	pos = position;
@@ -195,4 +373,116 @@ size_t MemIO::getLength()
 	return length;
 }
 
+size_t MemIO::readAt(size_t position, char *buffer, size_t length)
+{
+	if (position >= this->length)
+		return 0;
+	if (position + length > this->length)
+		length = this->length - position;
+
+	std::memcpy(buffer, this->buffer+position, length);
+	countRead(length);
+	return length;
+}
+
+const char *MemIO::view(size_t position, size_t &available)
+{
+	if (position >= length)
+		return nullptr;
+	available = length - position;
+	return buffer + position;
+}
+
+MmapIO::MmapIO(const char *filename)
+	: data(nullptr)
+	, pos(0)
+	, length(0)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		throw std::runtime_error("Could not open file");
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Could not open file");
+	}
+
+	// An empty file cannot be mapped, but it does not need to be either
+	length = info.st_size;
+	if (length > 0)
+	{
+		void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("Could not map file");
+		}
+
+		// We mostly walk the file front to back
+		madvise(mapping, length, MADV_SEQUENTIAL);
+		data = static_cast<const char*>(mapping);
+	}
+
+	// The mapping stays valid after closing
+	close(fd);
+}
+
+MmapIO::~MmapIO()
+{
+	if (data)
+		munmap(const_cast<char*>(data), length);
+}
+
+size_t MmapIO::read(char *buffer, size_t length)
+{
+	if (pos + length > this->length)
+		length = this->length - pos;
+
+	std::memcpy(buffer, data+pos, length);
+	pos += length;
+	countRead(length);
+	return length;
+}
+
+bool MmapIO::seek(size_t position)
+{
+	countSeek();
+	if (position >= length)
+		return false;
+	pos = position;
+	return true;
+}
+
+size_t MmapIO::tell()
+{
+	return pos;
+}
+
+size_t MmapIO::getLength()
+{
+	return length;
+}
+
+size_t MmapIO::readAt(size_t position, char *buffer, size_t length)
+{
+	if (position >= this->length)
+		return 0;
+	if (position + length > this->length)
+		length = this->length - position;
+
+	std::memcpy(buffer, data+position, length);
+	countRead(length);
+	return length;
+}
+
+const char *MmapIO::view(size_t position, size_t &available)
+{
+	if (position >= length)
+		return nullptr;
+	available = length - position;
+	return data + position;
+}
+
 } // matryona
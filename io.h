@@ -2,8 +2,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "errors.h"
+#include "stats.h"
 
 namespace matryona
 {
@@ -15,11 +17,55 @@ public:
 	virtual bool seek(std::size_t position) = 0;
 	virtual std::size_t tell() = 0;
 	virtual std::size_t getLength() = 0;
+
+	// Read at position, without using or moving the IO's own position. IOs
+	// that do this without any shared state (IOWindow, CIO, MemIO and MmapIO)
+	// can be read from several threads at once. The default seeks and reads,
+	// so it is only as thread-safe as those are.
+	virtual std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+
+	// IOs that have their contents in memory can hand out direct views of it.
+	// Returns a pointer to the data at position, valid for as long as the IO
+	// is, and sets available to the number of bytes after it. Returns nullptr
+	// if the IO has no such view.
+	virtual const char *view(std::size_t position, std::size_t &available);
+
+	// IOs reading straight from a file can give its descriptor, so it can be
+	// copied from in the kernel. Returns -1 for others.
+	virtual int getFileDescriptor();
+
+	// What has been done with this IO, if built with MATRYONA_STATS. The
+	// IOs here count their own calls, windows count on the IO they are a
+	// window into.
+	IOStats getIOStats() const;
+
+	// EBMLElement counts the headers it decodes here
+	virtual void countElementHeader();
+
+protected:
+	void countRead(std::size_t bytes)
+	{
+		reads.add();
+		bytesRead.add(bytes);
+	}
+
+	void countSeek()
+	{
+		seeks.add();
+	}
+
+private:
+	Counter<> reads;
+	Counter<> bytesRead;
+	Counter<> seeks;
+	Counter<> elementHeaders;
 };
 
 // IOWindow maps onto another IO, and provided a (smaller) window into it.
 // We'll end up using IOWindows a lot, to easily provide IO-backed views into
-// the file.
+// the file. Windows into windows are flattened, so they always refer to the
+// root IO. Windows only ever use readAt on it, so each window has its own
+// position, and windows on different threads don't get in each other's way.
 class IOWindow : public IO
 {
 public:
@@ -34,6 +80,9 @@ public:
 	bool seek(std::size_t position);
 	std::size_t tell();
 	std::size_t getLength();
+	std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+	const char *view(std::size_t position, std::size_t &available);
+	void countElementHeader();
 
 private:
 	IO *parent;
@@ -47,6 +96,60 @@ std::uint8_t readVintLength(IO *io);
 std::uint64_t readVint(IO *io);
 std::int64_t readSVint(IO *io);
 
+// The length of a vint, from its first byte. The number of leading zeroes,
+// plus one, is the length. A zero byte is invalid, and gives 0.
+inline std::uint8_t vintLength(std::uint8_t first)
+{
+	if (first == 0)
+		return 0;
+	return __builtin_clz(first) - (sizeof(unsigned int) - 1)*8 + 1;
+}
+
+// The fast path for vints that are already in memory. Returns the length of
+// the vint, or 0 if it is invalid or longer than the available data.
+inline std::uint8_t decodeVint(const std::uint8_t *data, std::size_t available, std::uint64_t &value)
+{
+	if (available == 0)
+		return 0;
+
+	std::uint8_t length = vintLength(data[0]);
+	if (length == 0 || length > available)
+		return 0;
+
+	if (available >= 8)
+	{
+		// Load 8 bytes at once, and shift away the ones that aren't ours
+		std::uint64_t raw;
+		std::memcpy(&raw, data, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		raw = __builtin_bswap64(raw);
+#endif
+		value = raw >> (64 - 8*length);
+	}
+	else
+	{
+		value = 0;
+		for (std::uint8_t i = 0; i < length; ++i)
+			value = (value << 8) | data[i];
+	}
+
+	// Then remove the leading 1
+	value &= (std::uint64_t(1) << (7*length)) - 1;
+	return length;
+}
+
+// The same for signed vints, which are stored with a bias of half their range
+inline std::uint8_t decodeSVint(const std::uint8_t *data, std::size_t available, std::int64_t &value)
+{
+	std::uint64_t raw;
+	std::uint8_t length = decodeVint(data, available, raw);
+	if (length == 0)
+		return 0;
+
+	value = std::int64_t(raw) - ((std::int64_t(1) << (7*length - 1)) - 1);
+	return length;
+}
+
 // Generic (non-efficient) endianness swapping
 template<typename T, unsigned int size = sizeof(T)>
 T swapEndianness(T value)
@@ -73,12 +176,12 @@ T readUint(std::uint64_t len, IO *io)
 	if (io->read(buffer, len) != len)
 		throw IOError();
 
+	// The value is stored in big endian, so this works regardless of our
+	// own endianness
 	for (std::uint64_t i = 0; i < len; i++)
 		value = (value << 8) | static_cast<std::uint8_t>(buffer[i]);
 
-	// FIXME: Do this only if little endian
-	value <<= (sizeof(T)-len)*8;
-	return swapEndianness(value);
+	return value;
 }
 
 // Blame C++ metaprogramming
@@ -99,16 +202,30 @@ struct equivalent_sized_uint<double>
 	typedef std::uint64_t type;
 };
 
+// Floats are stored as either 4 or 8 bytes, whichever type we want them in
 template <typename T = float>
 T readFloat(std::uint64_t len, IO *io)
 {
-	typedef typename equivalent_sized_uint<T>::type U;
-	char buffer[sizeof(T)];
-	*reinterpret_cast<U*>(buffer) = readUint<U>(len, io);
-	return *reinterpret_cast<T*>(buffer);
+	if (len == 4)
+	{
+		std::uint32_t bits = readUint<std::uint32_t>(len, io);
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	if (len == 8)
+	{
+		std::uint64_t bits = readUint<std::uint64_t>(len, io);
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	if (len == 0)
+		return 0;
+	throw InvalidFileFormatError("Invalid float size");
 }
 
-// An IO backed by fopen, fread and friends
+// An IO backed by fopen, fread and friends, and pread for readAt
 class CIO : public IO
 {
 public:
@@ -119,12 +236,44 @@ public:
 	bool seek(std::size_t position);
 	std::size_t tell();
 	std::size_t getLength();
+	std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+	int getFileDescriptor();
 
 private:
 	std::FILE *f;
 	std::size_t length;
 };
 
+// BufferedIO wraps another IO, and reads from it in large, aligned blocks.
+// Small reads and seeks within the buffered block never reach the parent, and
+// reading on sequentially doesn't even have to seek it. Its buffer is shared
+// state, so unlike the other IOs it can only be used from one thread.
+class BufferedIO : public IO
+{
+public:
+	BufferedIO(IO *parent, std::size_t blockSize = 64*1024);
+	~BufferedIO();
+	BufferedIO(const BufferedIO &other) = delete;
+
+	std::size_t read(char *buffer, std::size_t length);
+	bool seek(std::size_t position);
+	std::size_t tell();
+	std::size_t getLength();
+
+private:
+	IO *parent;
+	std::size_t parentPos;
+	std::size_t length;
+	std::size_t pos;
+
+	char *buffer;
+	std::size_t blockSize;
+	std::size_t bufferStart;
+	std::size_t bufferLength;
+
+	std::size_t readParent(std::size_t position, char *buffer, std::size_t length);
+};
+
 // An IO backed by a memory buffer
 class MemIO : public IO
 {
@@ -135,6 +284,8 @@ public:
 	bool seek(std::size_t position);
 	std::size_t tell();
 	std::size_t getLength();
+	std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+	const char *view(std::size_t position, std::size_t &available);
 
 private:
 	const char *buffer;
@@ -142,4 +293,25 @@ private:
 	std::size_t length;
 };
 
+// An IO backed by a read-only memory mapping of a file, so frames can be
+// used straight from the page cache
+class MmapIO : public IO
+{
+public:
+	MmapIO(const char *filename);
+	~MmapIO();
+
+	std::size_t read(char *buffer, std::size_t length);
+	bool seek(std::size_t position);
+	std::size_t tell();
+	std::size_t getLength();
+	std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+	const char *view(std::size_t position, std::size_t &available);
+
+private:
+	const char *data;
+	std::size_t pos;
+	std::size_t length;
+};
+
 } // matryona
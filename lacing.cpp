@@ -0,0 +1,115 @@
+#include "errors.h"
+#include "io.h"
+#include "lacing.h"
+
+using std::size_t;
+using std::int64_t;
+using std::uint64_t;
+using std::uint8_t;
+
+namespace matryona
+{
+
+Lacing lacingFromFlags(uint8_t flags)
+{
+	switch ((flags & 0x06) >> 1)
+	{
+	case 0b00:
+		return LACING_NONE;
+	case 0b01:
+		return LACING_XIPH;
+	case 0b10:
+		return LACING_FIXED;
+	default:
+		return LACING_EBML;
+	}
+}
+
+// Add a subpacket's size to where the previous one ends, if it fits in what is
+// left of the block after pos. The sizes come from the file, so they are
+// checked before adding, as their sum could otherwise wrap around.
+static size_t addLaceSize(size_t previous, uint64_t size, size_t pos, size_t blockSize)
+{
+	if (pos > blockSize || size > blockSize - pos || previous > blockSize - pos - size)
+		throw InvalidFileFormatError("Invalid lace sizes");
+	return previous + size;
+}
+
+void readLaceSizes(Lacing lacing, const uint8_t *data, size_t blockSize, size_t subpackets, std::vector<size_t> &laceOffsets)
+{
+	laceOffsets.resize(subpackets + 1);
+	laceOffsets[0] = 0;
+	laceOffsets[subpackets] = blockSize;
+
+	// For Xiph and EBML lacing, the sizes of all but the last subpacket come
+	// first, and the last subpacket gets what's left. We first sum the sizes,
+	// and move everything past the sizes when we know where they end.
+	size_t pos = 0;
+	switch (lacing)
+	{
+	case LACING_NONE:
+		return;
+	case LACING_FIXED:
+	{
+		// All subpackets are the same size
+		size_t size = blockSize/subpackets;
+		for (size_t i = 1; i < subpackets; ++i)
+			laceOffsets[i] = i*size;
+		return;
+	}
+	case LACING_XIPH:
+		// Sizes are a run of 255s, ended by a smaller byte, added together
+		for (size_t i = 1; i < subpackets; ++i)
+		{
+			size_t size = 0;
+			uint8_t part;
+			do
+			{
+				if (pos >= blockSize)
+					throw InvalidFileFormatError("Invalid lace sizes");
+				part = data[pos++];
+				size += part;
+			} while (part == 255);
+			laceOffsets[i] = addLaceSize(laceOffsets[i-1], size, pos, blockSize);
+		}
+		break;
+	case LACING_EBML:
+	{
+		// The first size is a vint, the next are signed vints with the
+		// difference to the previous size
+		int64_t size = 0;
+		for (size_t i = 1; i < subpackets; ++i)
+		{
+			uint8_t length;
+			if (i == 1)
+			{
+				uint64_t first;
+				length = decodeVint(data + pos, blockSize - pos, first);
+				size = first;
+			}
+			else
+			{
+				int64_t difference;
+				length = decodeSVint(data + pos, blockSize - pos, difference);
+				size += difference;
+			}
+
+			if (length == 0 || size < 0)
+				throw InvalidFileFormatError("Invalid lace sizes");
+			pos += length;
+			laceOffsets[i] = addLaceSize(laceOffsets[i-1], size, pos, blockSize);
+		}
+		break;
+	}
+	}
+
+	// Every subpacket has to start where the one before it does or later,
+	// and end within the block
+	for (size_t i = 0; i < subpackets; ++i)
+		laceOffsets[i] += pos;
+	for (size_t i = 0; i < subpackets; ++i)
+		if (laceOffsets[i] > laceOffsets[i+1])
+			throw InvalidFileFormatError("Invalid lace sizes");
+}
+
+} // matryona
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace matryona
+{
+
+// How the frames of a block are stored
+enum Lacing
+{
+	LACING_NONE,
+	LACING_EBML,
+	LACING_XIPH,
+	LACING_FIXED,
+};
+
+// The lacing in a block's flags
+Lacing lacingFromFlags(std::uint8_t flags);
+
+// Work out where each of the frames in a block's data starts, and where the
+// last one ends, into offsets. For Xiph and EBML lacing the data starts with
+// the sizes, for all lacing it starts after the frame count.
+void readLaceSizes(Lacing lacing, const std::uint8_t *data, std::size_t size, std::size_t frames, std::vector<std::size_t> &offsets);
+
+} // matryona
@@ -1,4 +1,12 @@
 #include <matryona/errors.h>
+#include <matryona/stats.h>
 #include <matryona/io.h>
+#include <matryona/output.h>
+#include <matryona/muxer.h>
+#include <matryona/pool.h>
+#include <matryona/packet.h>
 #include <matryona/ebml.h>
 #include <matryona/parser.h>
+#include <matryona/parallel.h>
+#include <matryona/prefetch.h>
+#include <matryona/push.h>
@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "ebml.h"
+#include "errors.h"
+#include "muxer.h"
+
+using std::size_t;
+using std::int64_t;
+using std::uint8_t;
+using std::uint64_t;
+
+namespace matryona
+{
+
+// The space left after the Segment's size for Info and the SeekHead. Both are
+// well under this, with room to spare for the Void that pads them.
+static const size_t headSize = 256;
+
+static const char *const appName = "matryona";
+
+// A Cluster's blocks store their time as a signed 16-bit offset from it
+static const int64_t minBlockOffset = -32768;
+static const int64_t maxBlockOffset = 32767;
+
+static const char *codecId(StreamType type)
+{
+	switch(type)
+	{
+	case VIDEO_VP8:
+		return "V_VP8";
+	case VIDEO_THEORA:
+		return "V_THEORA";
+	case AUDIO_VORBIS:
+		return "A_VORBIS";
+	default:
+		throw std::invalid_argument("Unknown stream type");
+	}
+}
+
+static bool isVideo(StreamType type)
+{
+	return type == VIDEO_VP8 || type == VIDEO_THEORA;
+}
+
+static void writeSeek(uint64_t id, uint64_t position, OutputIO *io)
+{
+	// SeekID is a binary holding an element ID, as it is stored in the file
+	MemOutputIO seekId;
+	writeVint(id, &seekId);
+
+	MemOutputIO seek;
+	writeBinaryElement(id::SeekID, seekId.getData(), seekId.getLength(), &seek);
+	writeUintElement(id::SeekPosition, position, &seek);
+	writeMasterElement(id::Seek, seek, io);
+}
+
+Muxer::Muxer(OutputIO *output, uint64_t timecodeScale)
+	: output(output)
+	, timecodeScale(timecodeScale)
+	, cueStream(0)
+	, clusterDuration(0)
+	, started(false)
+	, finalized(false)
+	, segmentSizePosition(0)
+	, segmentStart(0)
+	, endTimestamp(0)
+	, clusterOpen(false)
+	, clusterTimecode(0)
+	, clusterPosition(0)
+{
+	if (timecodeScale == 0)
+		throw std::invalid_argument("Invalid timecodeScale");
+	setClusterDuration(5000000000ull);
+}
+
+size_t Muxer::addTrack(const StreamInfo &info, const uint8_t *codecPrivate, size_t codecPrivateSize)
+{
+	if (started)
+		throw std::logic_error("Tracks have to be added before writing frames");
+	codecId(info.type);
+
+	Track track;
+	track.info = info;
+	track.info.trackNumber = tracks.size() + 1;
+	if (track.info.id == 0)
+		track.info.id = track.info.trackNumber;
+	if (codecPrivate)
+		track.codecPrivate.assign(codecPrivate, codecPrivate + codecPrivateSize);
+	track.clusterKeyframe = false;
+	track.lastTimecode = 0;
+	tracks.push_back(track);
+
+	// Clusters follow the first video track
+	if (isVideo(info.type) && !isVideo(tracks[cueStream].info.type))
+		cueStream = tracks.size() - 1;
+	return tracks.size() - 1;
+}
+
+void Muxer::setClusterDuration(uint64_t duration)
+{
+	clusterDuration = duration / timecodeScale;
+}
+
+void Muxer::start()
+{
+	started = true;
+
+	bool webm = true;
+	for (const Track &track : tracks)
+		if (track.info.type == VIDEO_THEORA)
+			webm = false;
+
+	// SimpleBlocks need DocTypeReadVersion 2
+	MemOutputIO ebml;
+	writeUintElement(id::EBMLVersion, 1, &ebml);
+	writeUintElement(id::EBMLReadVersion, 1, &ebml);
+	writeUintElement(id::EBMLMaxIDLength, 4, &ebml);
+	writeUintElement(id::EBMLMaxSizeLength, 8, &ebml);
+	writeStringElement(id::DocType, webm ? "webm" : "matroska", &ebml);
+	writeUintElement(id::DocTypeVersion, 2, &ebml);
+	writeUintElement(id::DocTypeReadVersion, 2, &ebml);
+
+	MemOutputIO header;
+	writeMasterElement(id::EBML, ebml, &header);
+
+	// The Segment's size is unknown until finalizing, but gets all 8 bytes
+	// so it can be filled in then
+	writeVint(id::Segment, &header);
+	segmentSizePosition = output->tell() + header.getLength();
+	writeVint(~uint64_t(0) >> 8, &header, 8);
+	segmentStart = segmentSizePosition + 8;
+
+	writeHead(&header, 0);
+	writeTracks(&header);
+
+	if (output->write(header.getData(), header.getLength()) != header.getLength())
+		throw IOError();
+}
+
+void Muxer::writeHead(OutputIO *io, uint64_t cuesPosition)
+{
+	MemOutputIO info;
+	writeUintElement(id::TimecodeScale, timecodeScale, &info);
+	if (finalized)
+		writeFloatElement(id::Duration, double(endTimestamp) / timecodeScale, &info);
+	writeStringElement(id::MuxingApp, appName, &info);
+	writeStringElement(id::WritingApp, appName, &info);
+
+	MemOutputIO seekHead;
+	if (finalized)
+	{
+		writeSeek(id::SegmentInfo, 0, &seekHead);
+		writeSeek(id::Tracks, headSize, &seekHead);
+		if (!cues.empty())
+			writeSeek(id::Cues, cuesPosition, &seekHead);
+	}
+
+	// A Void can't be a single byte, so if that is what would be left,
+	// Info's size takes a byte more instead
+	MemOutputIO head;
+	for (uint8_t infoSizeLength = 0; ; infoSizeLength = vintLengthOf(info.getLength()) + 1)
+	{
+		head.clear();
+		writeMasterElement(id::SegmentInfo, info, &head, infoSizeLength);
+		if (finalized)
+			writeMasterElement(id::SeekHead, seekHead, &head);
+		if (head.getLength() + 1 != headSize)
+			break;
+	}
+	if (head.getLength() > headSize)
+		throw std::logic_error("Segment head doesn't fit");
+
+	if (io->write(head.getData(), head.getLength()) != head.getLength())
+		throw IOError();
+	if (head.getLength() < headSize)
+		writeVoidElement(headSize - head.getLength(), io);
+}
+
+void Muxer::writeTracks(OutputIO *io)
+{
+	MemOutputIO tracksElement;
+	for (const Track &track : tracks)
+	{
+		MemOutputIO entry;
+		writeUintElement(id::TrackNumber, track.info.trackNumber, &entry);
+		writeUintElement(id::TrackUID, track.info.id, &entry);
+		writeUintElement(id::TrackType, isVideo(track.info.type) ? 1 : 2, &entry);
+		if (!track.info.isEnabled)
+			writeUintElement(id::FlagEnabled, 0, &entry);
+		if (!track.info.isDefault)
+			writeUintElement(id::FlagDefault, 0, &entry);
+		writeUintElement(id::FlagLacing, 0, &entry);
+		if (track.info.defaultDuration)
+			writeUintElement(id::DefaultDuration, track.info.defaultDuration, &entry);
+		writeStringElement(id::CodecID, codecId(track.info.type), &entry);
+		if (!track.codecPrivate.empty())
+			writeBinaryElement(id::CodecPrivate, track.codecPrivate.data(), track.codecPrivate.size(), &entry);
+
+		writeMasterElement(id::TrackEntry, entry, &tracksElement);
+	}
+	writeMasterElement(id::Tracks, tracksElement, io);
+}
+
+void Muxer::writeFrame(size_t stream, const uint8_t *data, size_t size, int64_t timestamp, bool keyframe)
+{
+	writeBlock(stream, data, size, timestamp, keyframe ? 0x80 : 0, false, 0);
+}
+
+void Muxer::writePacket(size_t stream, const Packet &packet)
+{
+	uint8_t flags = 0;
+	if (packet.keyframe)
+		flags |= 0x80;
+	if (packet.invisible)
+		flags |= 0x08;
+	if (packet.discardable)
+		flags |= 0x01;
+	writeBlock(stream, packet.data, packet.size, packet.timestamp, flags, true, packet.duration);
+}
+
+void Muxer::writeBlock(size_t stream, const uint8_t *data, size_t size, int64_t timestamp, uint8_t flags,
+		bool hasDuration, uint64_t duration)
+{
+	if (finalized)
+		throw std::logic_error("Writing after finalizing");
+	if (stream >= tracks.size())
+		throw std::out_of_range("No such stream");
+	if (!started)
+		start();
+
+	Track &track = tracks[stream];
+	bool keyframe = flags & 0x80;
+	int64_t scale = timecodeScale;
+	int64_t timecode = (timestamp < 0 ? timestamp - scale/2 : timestamp + scale/2) / scale;
+	int64_t offset = timecode - int64_t(clusterTimecode);
+	if (!clusterOpen || offset < minBlockOffset || offset > maxBlockOffset ||
+			(keyframe && stream == cueStream && offset >= int64_t(clusterDuration)))
+	{
+		// Clusters can't start before 0, but their blocks can
+		closeCluster();
+		clusterOpen = true;
+		clusterTimecode = std::max<int64_t>(timecode, 0);
+		clusterPosition = output->tell() - segmentStart;
+		writeUintElement(id::Timecode, clusterTimecode, &cluster);
+		offset = timecode - int64_t(clusterTimecode);
+		if (offset < minBlockOffset)
+			throw std::out_of_range("Timestamp too far before 0");
+	}
+
+	// The first keyframe of each track in a Cluster is where seeking can
+	// start from
+	if (keyframe && !track.clusterKeyframe)
+	{
+		track.clusterKeyframe = true;
+		cues.push_back({clusterTimecode + std::max<int64_t>(offset, 0), track.info.trackNumber, clusterPosition});
+	}
+
+	if (!hasDuration)
+		duration = track.info.defaultDuration;
+	uint64_t blockSize = vintLengthOf(track.info.trackNumber) + 3 + size;
+	if (duration == track.info.defaultDuration)
+	{
+		writeElementHeader(id::SimpleBlock, blockSize, &cluster);
+		writeVint(track.info.trackNumber, &cluster);
+		writeUint<uint16_t>(uint16_t(offset), 2, &cluster);
+		writeUint<uint8_t>(flags, 1, &cluster);
+		cluster.write(reinterpret_cast<const char*>(data), size);
+	}
+	else
+	{
+		// A duration of its own needs a BlockGroup. Its Block has no keyframe
+		// flag, so other frames reference the one before them instead, and
+		// there is no way to mark them discardable.
+		MemOutputIO extra;
+		writeUintElement(id::BlockDuration, (duration + scale/2) / scale, &extra);
+		if (!keyframe)
+			writeIntElement(id::ReferenceBlock, track.lastTimecode - timecode, &extra);
+
+		writeElementHeader(id::BlockGroup, vintLengthOf(id::Block) + vintLengthOf(blockSize) + blockSize + extra.getLength(), &cluster);
+		writeElementHeader(id::Block, blockSize, &cluster);
+		writeVint(track.info.trackNumber, &cluster);
+		writeUint<uint16_t>(uint16_t(offset), 2, &cluster);
+		writeUint<uint8_t>(flags & 0x08, 1, &cluster);
+		cluster.write(reinterpret_cast<const char*>(data), size);
+		cluster.write(extra.getData(), extra.getLength());
+	}
+	track.lastTimecode = timecode;
+
+	endTimestamp = std::max<int64_t>(endTimestamp, timestamp + int64_t(duration));
+}
+
+void Muxer::closeCluster()
+{
+	if (!clusterOpen)
+		return;
+
+	writeMasterElement(id::Cluster, cluster, output);
+	cluster.clear();
+	clusterOpen = false;
+	for (Track &track : tracks)
+		track.clusterKeyframe = false;
+}
+
+bool Muxer::finalize()
+{
+	if (finalized)
+		throw std::logic_error("Already finalized");
+	if (!started)
+		start();
+	closeCluster();
+
+	uint64_t cuesPosition = output->tell() - segmentStart;
+	if (!cues.empty())
+	{
+		// A Cluster can start earlier than the one before, when frames
+		// went back in time
+		std::stable_sort(cues.begin(), cues.end(), [](const Cue &a, const Cue &b) {
+			return a.timecode < b.timecode;
+		});
+
+		MemOutputIO cuesElement;
+		for (const Cue &cue : cues)
+		{
+			MemOutputIO positions;
+			writeUintElement(id::CueTrack, cue.trackNumber, &positions);
+			writeUintElement(id::CueClusterPosition, cue.clusterPosition, &positions);
+
+			MemOutputIO point;
+			writeUintElement(id::CueTime, cue.timecode, &point);
+			writeMasterElement(id::CueTrackPositions, positions, &point);
+			writeMasterElement(id::CuePoint, point, &cuesElement);
+		}
+		writeMasterElement(id::Cues, cuesElement, output);
+	}
+	uint64_t segmentSize = output->tell() - segmentStart;
+	finalized = true;
+
+	// The Segment's size is right before the head, so one seek does for both
+	MemOutputIO head;
+	writeVint(segmentSize, &head, 8);
+	writeHead(&head, cuesPosition);
+
+	if (!output->seek(segmentSizePosition))
+		return false;
+	if (output->write(head.getData(), head.getLength()) != head.getLength())
+		throw IOError();
+	return true;
+}
+
+} // matryona
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "output.h"
+#include "packet.h"
+#include "parser.h"
+
+namespace matryona
+{
+
+// Writes a WebM (or Matroska, for Theora) file in one streaming pass: the
+// Tracks first, then Clusters of SimpleBlocks (or BlockGroups), then the
+// Cues. Each Cluster is gathered in memory and written whole, so the output
+// sees few, large writes. Room for the SeekHead is left near the start, and
+// filled in when finalizing, together with the Segment's size and Duration.
+// That is the only time the output has to seek.
+class Muxer
+{
+public:
+	// Timestamps are in nanoseconds, like the Parser's. They are stored in
+	// ticks of timecodeScale nanoseconds, rounded to the nearest one, so
+	// that can't be 0.
+	Muxer(OutputIO *output, std::uint64_t timecodeScale = defaultTimecodeScale);
+	Muxer(const Muxer &other) = delete;
+
+	// Add a track, before writing any frames. Its type, defaultDuration and
+	// flags are taken from info, and it gets the next track number. Vorbis
+	// and Theora need their headers, Xiph laced, as codecPrivate. Returns the
+	// track's stream number, counting from 0 like the Parser's.
+	std::size_t addTrack(const StreamInfo &info, const std::uint8_t *codecPrivate = nullptr, std::size_t codecPrivateSize = 0);
+
+	// Start a new Cluster at a keyframe of the first video track (or the
+	// first track, without video) once the current one is this long, in
+	// nanoseconds. The default is 5 seconds.
+	void setClusterDuration(std::uint64_t duration);
+
+	// Write a frame. Timestamps may go back a bit from one frame to the
+	// next, when the streams aren't interleaved exactly, and a bit before 0.
+	void writeFrame(std::size_t stream, const std::uint8_t *data, std::size_t size, std::int64_t timestamp, bool keyframe);
+	// A packet keeps its flags, and its duration, in a BlockGroup when that
+	// isn't the track's defaultDuration
+	void writePacket(std::size_t stream, const Packet &packet);
+
+	// Write the last Cluster and the Cues, then go back to fill in the
+	// SeekHead, Info and Segment size. Nothing can be written after this. If
+	// the output can't seek, false is returned, and the file is left as a
+	// live recording would be: valid, but with the Segment's size unknown
+	// and no SeekHead.
+	bool finalize();
+
+private:
+	struct Track
+	{
+		StreamInfo info;
+		std::vector<std::uint8_t> codecPrivate;
+		// Whether the Cluster being gathered has a keyframe of the track yet
+		bool clusterKeyframe;
+		// The last frame's timecode, for a BlockGroup to reference
+		std::int64_t lastTimecode;
+	};
+
+	struct Cue
+	{
+		std::uint64_t timecode;
+		std::uint64_t trackNumber;
+		std::uint64_t clusterPosition;
+	};
+
+	OutputIO *output;
+	std::uint64_t timecodeScale;
+	std::vector<Track> tracks;
+	// The stream whose keyframes start Clusters, and how many ticks apart
+	std::size_t cueStream;
+	std::uint64_t clusterDuration;
+	bool started;
+	bool finalized;
+
+	// Where the Segment's size is in the output, and where its data starts.
+	// Positions in the SeekHead and Cues are relative to the latter.
+	std::size_t segmentSizePosition;
+	std::size_t segmentStart;
+	// The end of the last frame, for the Duration
+	std::int64_t endTimestamp;
+
+	MemOutputIO cluster;
+	bool clusterOpen;
+	std::uint64_t clusterTimecode;
+	std::size_t clusterPosition;
+	std::vector<Cue> cues;
+
+	void start();
+	// The space after the Segment's size: Info and, when finalizing, the
+	// SeekHead, padded with Void to the same size every time
+	void writeHead(OutputIO *io, std::uint64_t cuesPosition);
+	void writeTracks(OutputIO *io);
+	// Without a duration, or with the track's default one, a frame is a
+	// SimpleBlock
+	void writeBlock(std::size_t stream, const std::uint8_t *data, std::size_t size, std::int64_t timestamp, std::uint8_t flags,
+			bool hasDuration, std::uint64_t duration);
+	void closeCluster();
+};
+
+} // matryona
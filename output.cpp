@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "ebml.h"
+#include "output.h"
+
+using std::size_t;
+using std::int64_t;
+using std::uint8_t;
+using std::uint64_t;
+
+namespace matryona
+{
+
+size_t OutputIO::copyFrom(IO *input, size_t position, size_t length)
+{
+	// Straight from memory, if the input has it there
+	size_t available = 0;
+	const char *data = input->view(position, available);
+	if (data && available >= length)
+		return write(data, length);
+
+	// Otherwise in large blocks
+	std::vector<char> buffer(std::min<size_t>(length, 1024*1024));
+	size_t done = 0;
+	while (done < length)
+	{
+		size_t amount = input->readAt(position + done, buffer.data(), std::min(buffer.size(), length - done));
+		if (amount == 0)
+			break;
+
+		size_t written = write(buffer.data(), amount);
+		done += written;
+		if (written != amount)
+			break;
+	}
+
+	return done;
+}
+
+FileOutputIO::FileOutputIO(const char *filename, size_t blockSize)
+	: pos(0)
+	, buffer(nullptr)
+	, blockSize(std::max<size_t>(blockSize, 1))
+	, buffered(0)
+{
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		throw std::runtime_error("Could not open file");
+	buffer = new char[this->blockSize];
+}
+
+FileOutputIO::~FileOutputIO()
+{
+	flush();
+	close(fd);
+	delete[] buffer;
+}
+
+size_t FileOutputIO::writeFile(const char *buffer, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t result = ::write(fd, buffer + done, length - done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		done += result;
+	}
+
+	return done;
+}
+
+bool FileOutputIO::flush()
+{
+	// What couldn't be written stays buffered, as pos still counts it
+	size_t written = writeFile(buffer, buffered);
+	std::memmove(buffer, buffer + written, buffered - written);
+	buffered -= written;
+	return buffered == 0;
+}
+
+size_t FileOutputIO::write(const char *buffer, size_t length)
+{
+	if (buffered + length > blockSize && !flush())
+		return 0;
+
+	// What doesn't fit in the buffer isn't worth buffering
+	if (length >= blockSize)
+	{
+		size_t written = writeFile(buffer, length);
+		pos += written;
+		return written;
+	}
+
+	std::memcpy(this->buffer + buffered, buffer, length);
+	buffered += length;
+	pos += length;
+	return length;
+}
+
+bool FileOutputIO::seek(size_t position)
+{
+	if (!flush() || lseek(fd, position, SEEK_SET) != off_t(position))
+		return false;
+	pos = position;
+	return true;
+}
+
+size_t FileOutputIO::tell()
+{
+	return pos;
+}
+
+size_t FileOutputIO::copyFrom(IO *input, size_t position, size_t length)
+{
+#ifdef __linux__
+	int source = input->getFileDescriptor();
+	if (source < 0)
+		return OutputIO::copyFrom(input, position, length);
+	if (!flush())
+		return 0;
+
+	// Have the kernel copy it. copy_file_range can even share the data
+	// between the files, on file systems that support that. Where it
+	// doesn't work sendfile might, and whatever neither of them copied we
+	// copy ourselves.
+	size_t done = 0;
+	bool copyFileRange = true;
+	while (done < length)
+	{
+		ssize_t result;
+		if (copyFileRange)
+		{
+			loff_t from = position + done;
+			result = copy_file_range(source, &from, fd, nullptr, length - done, 0);
+			if (result < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				copyFileRange = false;
+				continue;
+			}
+		}
+		else
+		{
+			off_t from = position + done;
+			result = sendfile(fd, source, &from, length - done);
+		}
+
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		done += result;
+	}
+	pos += done;
+
+	if (done < length)
+		done += OutputIO::copyFrom(input, position + done, length - done);
+	return done;
+#else
+	// Copying in the kernel is Linux only
+	return OutputIO::copyFrom(input, position, length);
+#endif
+}
+
+MemOutputIO::MemOutputIO()
+	: pos(0)
+{
+}
+
+size_t MemOutputIO::write(const char *buffer, size_t length)
+{
+	if (pos == data.size())
+		data.insert(data.end(), buffer, buffer + length);
+	else
+	{
+		if (pos + length > data.size())
+			data.resize(pos + length);
+		std::memcpy(data.data() + pos, buffer, length);
+	}
+	pos += length;
+	return length;
+}
+
+bool MemOutputIO::seek(size_t position)
+{
+	if (position > data.size())
+		return false;
+	pos = position;
+	return true;
+}
+
+size_t MemOutputIO::tell()
+{
+	return pos;
+}
+
+const char *MemOutputIO::getData() const
+{
+	return data.data();
+}
+
+size_t MemOutputIO::getLength() const
+{
+	return data.size();
+}
+
+void MemOutputIO::clear()
+{
+	data.clear();
+	pos = 0;
+}
+
+uint8_t vintLengthOf(uint64_t value)
+{
+	uint8_t length = 1;
+	while (length < 8 && value >= (uint64_t(1) << (7*length)) - 1)
+		++length;
+	return length;
+}
+
+void writeVint(uint64_t value, OutputIO *io, uint8_t length)
+{
+	if (length == 0)
+		length = vintLengthOf(value);
+
+	// The length marker goes right above the value
+	writeUint(value | (uint64_t(1) << (7*length)), length, io);
+}
+
+uint8_t uintLengthOf(uint64_t value)
+{
+	uint8_t length = 1;
+	while (length < 8 && value >> (8*length) != 0)
+		++length;
+	return length;
+}
+
+uint8_t intLengthOf(int64_t value)
+{
+	// Bits above the top one of length bytes have to repeat its sign
+	uint8_t length = 1;
+	while (length < 8 && (value >> (8*length - 1) != 0 && value >> (8*length - 1) != -1))
+		++length;
+	return length;
+}
+
+void writeElementHeader(uint64_t id, uint64_t size, OutputIO *io, uint8_t sizeLength)
+{
+	writeVint(id, io);
+	writeVint(size, io, sizeLength);
+}
+
+void writeUintElement(uint64_t id, uint64_t value, OutputIO *io)
+{
+	uint8_t length = uintLengthOf(value);
+	writeElementHeader(id, length, io);
+	writeUint(value, length, io);
+}
+
+void writeIntElement(uint64_t id, int64_t value, OutputIO *io)
+{
+	uint8_t length = intLengthOf(value);
+	writeElementHeader(id, length, io);
+	writeUint(uint64_t(value), length, io);
+}
+
+void writeFloatElement(uint64_t id, double value, OutputIO *io)
+{
+	writeElementHeader(id, sizeof(value), io);
+	writeFloat(value, io);
+}
+
+void writeBinaryElement(uint64_t id, const void *data, size_t size, OutputIO *io)
+{
+	writeElementHeader(id, size, io);
+	if (io->write(static_cast<const char*>(data), size) != size)
+		throw IOError();
+}
+
+void writeStringElement(uint64_t id, const char *value, OutputIO *io)
+{
+	writeBinaryElement(id, value, std::strlen(value), io);
+}
+
+void writeMasterElement(uint64_t id, const MemOutputIO &contents, OutputIO *io, uint8_t sizeLength)
+{
+	writeElementHeader(id, contents.getLength(), io, sizeLength);
+	if (io->write(contents.getData(), contents.getLength()) != contents.getLength())
+		throw IOError();
+}
+
+void writeVoidElement(size_t size, OutputIO *io)
+{
+	// Sizes up to 126 fit in one byte, larger ones get eight, so there is no
+	// gap where neither fits
+	uint8_t sizeLength = size - 2 < 127 ? 1 : 8;
+	size_t remaining = size - 1 - sizeLength;
+	writeElementHeader(id::Void, remaining, io, sizeLength);
+
+	static const char zeroes[4096] = {};
+	while (remaining > 0)
+	{
+		size_t amount = std::min(remaining, sizeof(zeroes));
+		if (io->write(zeroes, amount) != amount)
+			throw IOError();
+		remaining -= amount;
+	}
+}
+
+} // matryona
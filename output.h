@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "errors.h"
+#include "io.h"
+
+namespace matryona
+{
+
+// Somewhere to write to, the other way around from IO
+class OutputIO
+{
+public:
+	virtual std::size_t write(const char *buffer, std::size_t length) = 0;
+	virtual bool seek(std::size_t position) = 0;
+	virtual std::size_t tell() = 0;
+
+	// Write length bytes of input from position. Returns how many were
+	// written. The default writes straight from the input's view if it has
+	// one, and otherwise reads and writes in large blocks.
+	virtual std::size_t copyFrom(IO *input, std::size_t position, std::size_t length);
+};
+
+// An OutputIO writing to a file. Small writes are gathered in a buffer of
+// blockSize bytes, larger ones go to the file directly. Copies from an IO
+// with a file descriptor are done in the kernel, with copy_file_range or
+// sendfile, so the data never passes through us.
+class FileOutputIO : public OutputIO
+{
+public:
+	FileOutputIO(const char *filename, std::size_t blockSize = 64*1024);
+	~FileOutputIO();
+	FileOutputIO(const FileOutputIO &other) = delete;
+
+	std::size_t write(const char *buffer, std::size_t length);
+	bool seek(std::size_t position);
+	std::size_t tell();
+	std::size_t copyFrom(IO *input, std::size_t position, std::size_t length);
+
+	// Write out what is buffered. Returns false if not all of it could be,
+	// keeping the rest buffered.
+	bool flush();
+
+private:
+	int fd;
+	// Where we are in the file, including what is buffered
+	std::size_t pos;
+
+	char *buffer;
+	std::size_t blockSize;
+	std::size_t buffered;
+
+	std::size_t writeFile(const char *buffer, std::size_t length);
+};
+
+// An OutputIO into memory, growing as needed. Seeking past the end is not
+// possible.
+class MemOutputIO : public OutputIO
+{
+public:
+	MemOutputIO();
+
+	std::size_t write(const char *buffer, std::size_t length);
+	bool seek(std::size_t position);
+	std::size_t tell();
+
+	const char *getData() const;
+	std::size_t getLength() const;
+	// Start over, keeping the memory for reuse
+	void clear();
+
+private:
+	std::vector<char> data;
+	std::size_t pos;
+};
+
+// Writing EBML, the other way around from readVint, readUint and readFloat.
+// They all throw an IOError if not everything could be written.
+
+// The length of the shortest vint that holds value. A vint of all ones means
+// an unknown size, so values like 127 take one more byte.
+std::uint8_t vintLengthOf(std::uint64_t value);
+// Write a vint of length bytes, or as short as possible if length is 0.
+// Element IDs are written this way too, as we keep them without their length
+// marker.
+void writeVint(std::uint64_t value, OutputIO *io, std::uint8_t length = 0);
+
+// The length of the shortest uint that holds value, at least one byte
+std::uint8_t uintLengthOf(std::uint64_t value);
+// The same for a signed int, in two's complement
+std::uint8_t intLengthOf(std::int64_t value);
+
+template <typename T = std::uint64_t>
+void writeUint(T value, std::uint64_t len, OutputIO *io)
+{
+	if (len > sizeof(T))
+		len = sizeof(T);
+	char buffer[sizeof(T)];
+	for (std::uint64_t i = 0; i < len; i++)
+		buffer[i] = static_cast<char>(value >> (8*(len - 1 - i)));
+
+	if (io->write(buffer, len) != len)
+		throw IOError();
+}
+
+template <typename T = float>
+void writeFloat(T value, OutputIO *io)
+{
+	typedef typename equivalent_sized_uint<T>::type U;
+	U bits;
+	static_assert(sizeof(bits) == sizeof(value), "Float and uint sizes differ");
+	std::memcpy(&bits, &value, sizeof(bits));
+	writeUint<U>(bits, sizeof(U), io);
+}
+
+// Whole elements. The size is written as short as possible, unless
+// sizeLength says otherwise.
+void writeElementHeader(std::uint64_t id, std::uint64_t size, OutputIO *io, std::uint8_t sizeLength = 0);
+void writeUintElement(std::uint64_t id, std::uint64_t value, OutputIO *io);
+void writeIntElement(std::uint64_t id, std::int64_t value, OutputIO *io);
+void writeFloatElement(std::uint64_t id, double value, OutputIO *io);
+void writeBinaryElement(std::uint64_t id, const void *data, std::size_t size, OutputIO *io);
+void writeStringElement(std::uint64_t id, const char *value, OutputIO *io);
+// A master element, with what was gathered for it in memory
+void writeMasterElement(std::uint64_t id, const MemOutputIO &contents, OutputIO *io, std::uint8_t sizeLength = 0);
+// A Void element of size bytes, header included. That is at least 2.
+void writeVoidElement(std::size_t size, OutputIO *io);
+
+} // matryona
@@ -0,0 +1,173 @@
+#include <new>
+
+#include "packet.h"
+
+using std::size_t;
+using std::uint8_t;
+
+namespace matryona
+{
+
+// The data starts after the PacketBuffer itself, suitably aligned
+static const size_t headerSize = (sizeof(PacketBuffer) + 15) & ~size_t(15);
+
+PacketBuffer::PacketBuffer(BufferPool *pool, size_t allocated)
+	: refs(1)
+	, pool(pool)
+	, allocated(allocated)
+{
+}
+
+PacketBuffer *PacketBuffer::create(size_t size, BufferPool *pool)
+{
+	size_t allocated = size + headerSize;
+	uint8_t *memory;
+	if (pool)
+		memory = pool->acquire(allocated, allocated);
+	else
+		memory = new uint8_t[allocated];
+
+	return new (memory) PacketBuffer(pool, allocated);
+}
+
+void PacketBuffer::ref()
+{
+	refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PacketBuffer::unref()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	BufferPool *pool = this->pool;
+	size_t allocated = this->allocated;
+	uint8_t *memory = reinterpret_cast<uint8_t*>(this);
+	this->~PacketBuffer();
+
+	if (pool)
+		pool->release(memory, allocated);
+	else
+		delete[] memory;
+}
+
+bool PacketBuffer::isShared() const
+{
+	return refs.load(std::memory_order_acquire) > 1;
+}
+
+uint8_t *PacketBuffer::getData()
+{
+	return reinterpret_cast<uint8_t*>(this) + headerSize;
+}
+
+size_t PacketBuffer::getCapacity() const
+{
+	return allocated - headerSize;
+}
+
+Packet::Packet()
+	: data(nullptr)
+	, size(0)
+	, timestamp(0)
+	, duration(0)
+	, keyframe(false)
+	, invisible(false)
+	, discardable(false)
+	, buffer(nullptr)
+{
+}
+
+Packet::Packet(PacketBuffer *buffer, const uint8_t *data, size_t size)
+	: data(data)
+	, size(size)
+	, timestamp(0)
+	, duration(0)
+	, keyframe(false)
+	, invisible(false)
+	, discardable(false)
+	, buffer(buffer)
+{
+	if (buffer)
+		buffer->ref();
+}
+
+Packet::Packet(const Packet &other)
+	: data(other.data)
+	, size(other.size)
+	, timestamp(other.timestamp)
+	, duration(other.duration)
+	, keyframe(other.keyframe)
+	, invisible(other.invisible)
+	, discardable(other.discardable)
+	, buffer(other.buffer)
+{
+	if (buffer)
+		buffer->ref();
+}
+
+Packet::Packet(Packet &&other)
+	: data(other.data)
+	, size(other.size)
+	, timestamp(other.timestamp)
+	, duration(other.duration)
+	, keyframe(other.keyframe)
+	, invisible(other.invisible)
+	, discardable(other.discardable)
+	, buffer(other.buffer)
+{
+	other.buffer = nullptr;
+	other.release();
+}
+
+Packet::~Packet()
+{
+	release();
+}
+
+Packet &Packet::operator=(const Packet &other)
+{
+	if (other.buffer)
+		other.buffer->ref();
+	release();
+
+	data = other.data;
+	size = other.size;
+	timestamp = other.timestamp;
+	duration = other.duration;
+	keyframe = other.keyframe;
+	invisible = other.invisible;
+	discardable = other.discardable;
+	buffer = other.buffer;
+	return *this;
+}
+
+Packet &Packet::operator=(Packet &&other)
+{
+	if (this == &other)
+		return *this;
+	release();
+
+	data = other.data;
+	size = other.size;
+	timestamp = other.timestamp;
+	duration = other.duration;
+	keyframe = other.keyframe;
+	invisible = other.invisible;
+	discardable = other.discardable;
+	buffer = other.buffer;
+	other.buffer = nullptr;
+	other.release();
+	return *this;
+}
+
+void Packet::release()
+{
+	if (buffer)
+		buffer->unref();
+	buffer = nullptr;
+	data = nullptr;
+	size = 0;
+}
+
+} // matryona
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "pool.h"
+
+namespace matryona
+{
+
+// Reference counted storage for packet data, optionally from a BufferPool.
+// The data follows the bookkeeping in the same allocation.
+class PacketBuffer
+{
+public:
+	// Returns a buffer of at least size bytes, with one reference
+	static PacketBuffer *create(std::size_t size, BufferPool *pool);
+
+	void ref();
+	void unref();
+	bool isShared() const;
+
+	std::uint8_t *getData();
+	std::size_t getCapacity() const;
+
+private:
+	PacketBuffer(BufferPool *pool, std::size_t allocated);
+	PacketBuffer(const PacketBuffer &other) = delete;
+
+	std::atomic<unsigned int> refs;
+	BufferPool *pool;
+	std::size_t allocated;
+};
+
+// A frame from a stream. Unlike the data from Parser::readData, it stays valid
+// until the Packet and all copies of it are released or destroyed, so it can
+// be handed to other threads.
+struct Packet
+{
+	Packet();
+	Packet(PacketBuffer *buffer, const std::uint8_t *data, std::size_t size);
+	Packet(const Packet &other);
+	Packet(Packet &&other);
+	~Packet();
+
+	Packet &operator=(const Packet &other);
+	Packet &operator=(Packet &&other);
+
+	// Let go of the data
+	void release();
+
+	const std::uint8_t *data;
+	std::size_t size;
+	// In nanoseconds. A block's time is relative to its Cluster's and can
+	// be before it, so timestamps can be negative.
+	std::int64_t timestamp;
+	std::uint64_t duration;
+	bool keyframe;
+	// Decoded, but not meant to be shown
+	bool invisible;
+	// Can be dropped, without affecting other frames
+	bool discardable;
+
+private:
+	// Keeps the data alive, or nullptr if it lives in the IO itself
+	PacketBuffer *buffer;
+};
+
+} // matryona
@@ -0,0 +1,139 @@
+#include "parallel.h"
+
+using std::size_t;
+using std::uint64_t;
+
+namespace matryona
+{
+
+ParallelReader::ParallelReader(Parser &parser, unsigned int threads, size_t window)
+	: parser(parser)
+	, window(window)
+	, stopping(false)
+	, clusters(&parser.segment.io)
+	, scanned(false)
+	, claimed(0)
+	, emitted(0)
+	, emitPos(0)
+{
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	if (this->window == 0)
+		this->window = 4*threads;
+
+	// Codec headers some streams have in their CodecPrivate come first
+	parser.readCodecHeaders(batches[0].packets);
+	claimed = 1;
+
+	for (unsigned int i = 0; i < threads; ++i)
+		workers.emplace_back(&ParallelReader::work, this);
+}
+
+ParallelReader::~ParallelReader()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	space.notify_all();
+
+	for (std::thread &worker : workers)
+		worker.join();
+}
+
+void ParallelReader::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		// Don't run too far ahead of the reader
+		space.wait(lock, [this] { return stopping || scanned || claimed < emitted + window; });
+		if (stopping || scanned)
+			return;
+
+		// Claim the next Cluster. Finding it can fail on broken files, in
+		// which case the reader gets the error once it gets here.
+		uint64_t number = claimed;
+		size_t position = 0;
+		size_t end = 0;
+		Batch batch;
+		try
+		{
+			clusters.until(id::Cluster);
+			if (clusters == EBMLElementIterator::end)
+			{
+				scanned = true;
+				ready.notify_all();
+				space.notify_all();
+				return;
+			}
+			// Moving on finds where the Cluster ends, also if its size is
+			// unknown
+			position = clusters.getPosition();
+			++clusters;
+			end = clusters.getPosition();
+		}
+		catch (...)
+		{
+			batch.error = std::current_exception();
+			scanned = true;
+		}
+		++claimed;
+
+		// Then parse it on our own
+		if (!batch.error)
+		{
+			lock.unlock();
+			try
+			{
+				parser.readCluster(position, end, batch.packets);
+			}
+			catch (...)
+			{
+				batch.error = std::current_exception();
+			}
+			lock.lock();
+		}
+
+		batches[number] = std::move(batch);
+		ready.notify_all();
+	}
+}
+
+bool ParallelReader::readPacket(size_t &stream, Packet &packet)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		// Wait for the next Cluster in line, unless there are none left
+		auto it = batches.end();
+		ready.wait(lock, [&] {
+			it = batches.find(emitted);
+			return it != batches.end() || (scanned && emitted >= claimed);
+		});
+		if (it == batches.end())
+			return false;
+
+		Batch &batch = it->second;
+		if (batch.error)
+			std::rethrow_exception(batch.error);
+
+		if (emitPos < batch.packets.size())
+		{
+			stream = batch.packets[emitPos].first;
+			packet = std::move(batch.packets[emitPos].second);
+			++emitPos;
+			return true;
+		}
+
+		// Done with this one, let the workers continue
+		batches.erase(it);
+		++emitted;
+		emitPos = 0;
+		space.notify_all();
+	}
+}
+
+} // matryona
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ebml.h"
+#include "packet.h"
+#include "parser.h"
+
+namespace matryona
+{
+
+// ParallelReader reads a whole file with a number of worker threads, each
+// parsing whole Clusters at a time. The frames come out in file order, so in
+// order per stream, no matter which worker finished first. The IO has to
+// allow concurrent reads (see IO::readAt), and the Parser has to outlive us.
+// Streams that are not selected in the Parser are skipped, the streams' own
+// positions are not used or changed.
+class ParallelReader
+{
+public:
+	// With 0 threads we use one per core. Workers run at most window
+	// Clusters ahead of the reader, 0 means four per thread.
+	ParallelReader(Parser &parser, unsigned int threads = 0, std::size_t window = 0);
+	~ParallelReader();
+	ParallelReader(const ParallelReader &other) = delete;
+
+	// Get the next frame of any stream, waiting for the workers if needed.
+	// Errors from parsing a Cluster are thrown here, in order.
+	bool readPacket(std::size_t &stream, Packet &packet);
+
+private:
+	// The frames of one Cluster
+	struct Batch
+	{
+		std::vector<std::pair<std::size_t, Packet>> packets;
+		std::exception_ptr error;
+	};
+
+	Parser &parser;
+	std::vector<std::thread> workers;
+	std::size_t window;
+
+	std::mutex mutex;
+	// Signalled when a Batch is done, or there are no more Clusters
+	std::condition_variable ready;
+	// Signalled when the reader is done with a Batch, or we're stopping
+	std::condition_variable space;
+	bool stopping;
+
+	// The workers take turns finding the next Cluster, which only takes
+	// reading its header
+	EBMLElementIterator clusters;
+	bool scanned;
+	std::uint64_t claimed;
+
+	// Finished Clusters, by their number, until the reader gets to them
+	std::map<std::uint64_t, Batch> batches;
+	std::uint64_t emitted;
+	std::size_t emitPos;
+
+	void work();
+};
+
+} // matryona
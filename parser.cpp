@@ -1,15 +1,22 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 
+#include "lacing.h"
 #include "parser.h"
 
 using std::size_t;
+using std::int64_t;
 using std::uint64_t;
 using std::uint8_t;
 using std::int8_t;
 
-static const uint64_t Codec_Audio_Vorbis = 0x534942524f565f41;
-static const uint64_t Codec_Video_Vp8 = 0x3850565f56;
-static const uint64_t Codec_Video_Theora = 0x41524f4548545f56;
+// The first 8 bytes of the CodecID strings, read as big endian ints
+static const uint64_t Codec_Audio_Vorbis = 0x415f564f52424953; // A_VORBIS
+static const uint64_t Codec_Video_Vp8 = 0x565f565038; // V_VP8
+static const uint64_t Codec_Video_Theora = 0x565f5448454f5241; // V_THEORA
 
 namespace matryona
 {
@@ -29,26 +36,6 @@ const char *streamTypeName(StreamType type)
 	}
 }
 
-Parser::Parser(IO *input)
-	: input(input)
-{
-	readHeader();
-}
-
-Parser::~Parser()
-{
-}
-
-size_t Parser::getNumStreams() const
-{
-	return streams.size();
-}
-
-const StreamInfo &Parser::getStreamInfo(size_t stream) const
-{
-	return streams[stream];
-}
-
 static EBMLElement findElement(IO *io, uint64_t id)
 {
 	for (EBMLElementIterator it(io); it != EBMLElementIterator::end; ++it)
@@ -57,6 +44,21 @@ static EBMLElement findElement(IO *io, uint64_t id)
 	throw InvalidFileFormatError("Missing required element");
 }
 
+// Header elements we parse completely are read into memory in one go (unless
+// they're there already), so parsing them doesn't take a read per element
+static const char *loadElement(EBMLElement &element, std::vector<char> &storage)
+{
+	size_t available = 0;
+	const char *data = element.io.view(0, available);
+	if (data && available >= element.size)
+		return data;
+
+	storage.resize(element.size);
+	if (element.io.readAt(0, storage.data(), storage.size()) != storage.size())
+		throw IOError();
+	return storage.data();
+}
+
 static StreamType typeFromId(uint64_t id)
 {
 	switch(id)
@@ -72,6 +74,284 @@ static StreamType typeFromId(uint64_t id)
 	}
 }
 
+// The EBML header elements we check
+struct EBMLHeaderFields
+{
+	uint64_t readVersion;
+	EBMLElement docType;
+};
+
+static void keepDocType(EBMLHeaderFields &header, EBMLElement &element)
+{
+	header.docType = element;
+}
+
+static constexpr ElementHandler<EBMLHeaderFields> ebmlHeaderHandlers[] =
+{
+	uintField<EBMLHeaderFields, &EBMLHeaderFields::readVersion>(id::EBMLReadVersion),
+	handler<EBMLHeaderFields>(id::DocType, TYPE_STRING, keepDocType),
+};
+static_assert(matchesSchema(ebmlHeaderHandlers, id::EBML), "EBML header handlers don't match the schema");
+
+void checkEBMLHeader(IO *header)
+{
+	EBMLHeaderFields fields;
+	visitChildren(header, fields, ebmlHeaderHandlers);
+
+	// Check EBML version
+	if (fields.readVersion > 1)
+		throw InvalidFileFormatError("Invalid EBML version");
+
+	// Check if DocType is "matroska" or "webm"
+	EBMLElement &docType = fields.docType;
+	if (docType.size > 16)
+		throw InvalidFileFormatError("Format not recognized");
+	char buffer[16];
+	docType.io.read(buffer, docType.size);
+	if (std::strncmp(buffer, "matroska", docType.size) != 0 &&
+			std::strncmp(buffer, "webm", docType.size) != 0)
+		throw InvalidFileFormatError("Format not recognized");
+}
+
+static void readDuration(SegmentInfo &info, EBMLElement &element)
+{
+	info.duration = readFloat<double>(element.size, &element.io);
+	info.hasDuration = true;
+}
+
+static constexpr ElementHandler<SegmentInfo> segmentInfoHandlers[] =
+{
+	uintField<SegmentInfo, &SegmentInfo::timecodeScale>(id::TimecodeScale),
+	handler<SegmentInfo>(id::Duration, TYPE_FLOAT, readDuration),
+};
+static_assert(matchesSchema(segmentInfoHandlers, id::SegmentInfo), "SegmentInfo handlers don't match the schema");
+
+SegmentInfo readSegmentInfo(IO *segmentInfo)
+{
+	SegmentInfo info;
+	info.timecodeScale = defaultTimecodeScale;
+	info.hasDuration = false;
+	info.duration = 0;
+	visitChildren(segmentInfo, info, segmentInfoHandlers);
+
+	if (info.timecodeScale == 0)
+		throw InvalidFileFormatError("Invalid TimecodeScale");
+	return info;
+}
+
+// The TrackEntry elements we read, before they make a TrackEntry
+struct TrackEntryFields
+{
+	uint64_t codecId;
+	uint64_t uid;
+	uint64_t trackNumber;
+	uint64_t defaultDuration;
+	bool isEnabled;
+	bool isDefault;
+	float timecodeScale;
+	EBMLElement codecPrivate;
+};
+
+static void keepCodecPrivate(TrackEntryFields &entry, EBMLElement &element)
+{
+	entry.codecPrivate = element;
+}
+
+static constexpr ElementHandler<TrackEntryFields> trackEntryHandlers[] =
+{
+	// Only the first 8 bytes of the CodecID string, see typeFromId
+	handler<TrackEntryFields>(id::CodecID, TYPE_STRING, readUintField<TrackEntryFields, &TrackEntryFields::codecId>),
+	uintField<TrackEntryFields, &TrackEntryFields::uid>(id::TrackUID),
+	uintField<TrackEntryFields, &TrackEntryFields::trackNumber>(id::TrackNumber),
+	uintField<TrackEntryFields, &TrackEntryFields::defaultDuration>(id::DefaultDuration),
+	flagField<TrackEntryFields, &TrackEntryFields::isEnabled>(id::FlagEnabled),
+	flagField<TrackEntryFields, &TrackEntryFields::isDefault>(id::FlagDefault),
+	floatField<TrackEntryFields, &TrackEntryFields::timecodeScale>(id::TrackTimecodeScale),
+	handler<TrackEntryFields>(id::CodecPrivate, TYPE_BINARY, keepCodecPrivate),
+};
+static_assert(matchesSchema(trackEntryHandlers, id::TrackEntry), "TrackEntry handlers don't match the schema");
+
+TrackEntry readTrackEntry(IO *trackEntry)
+{
+	TrackEntryFields fields;
+	fields.defaultDuration = 0;
+	fields.isEnabled = true;
+	fields.isDefault = true;
+	fields.timecodeScale = 1;
+	visitChildren(trackEntry, fields, trackEntryHandlers);
+
+	TrackEntry entry;
+	entry.info.type = typeFromId(fields.codecId);
+	entry.info.id = fields.uid;
+	entry.info.trackNumber = fields.trackNumber;
+	entry.info.defaultDuration = fields.defaultDuration;
+	entry.info.isEnabled = fields.isEnabled;
+	entry.info.isDefault = fields.isDefault;
+	entry.timecodeScale = fields.timecodeScale;
+	entry.codecPrivate = fields.codecPrivate;
+	return entry;
+}
+
+StreamInfo readStreamInfo(IO *trackEntry)
+{
+	return readTrackEntry(trackEntry).info;
+}
+
+int64_t trackTimestampScale(uint64_t timecodeScale, float trackTimecodeScale)
+{
+	// Nearly every file leaves TrackTimecodeScale at 1, anything not
+	// positive makes no sense
+	if (trackTimecodeScale == 1 || !(trackTimecodeScale > 0))
+		return timecodeScale;
+	return std::max<int64_t>(std::llround(timecodeScale * double(trackTimecodeScale)), 1);
+}
+
+static void setDuration(BlockGroup &group, EBMLElement &element)
+{
+	group.duration = readUint(element.size, &element.io);
+	group.hasDuration = true;
+}
+
+static void setReference(BlockGroup &group, EBMLElement &)
+{
+	group.hasReference = true;
+}
+
+static void keepBlock(BlockGroup &group, EBMLElement &element)
+{
+	group.block = element;
+}
+
+static constexpr ElementHandler<BlockGroup> blockGroupHandlers[] =
+{
+	handler<BlockGroup>(id::Block, TYPE_BINARY, keepBlock),
+	handler<BlockGroup>(id::BlockDuration, TYPE_UINT, setDuration),
+	handler<BlockGroup>(id::ReferenceBlock, TYPE_INT, setReference),
+};
+static_assert(matchesSchema(blockGroupHandlers, id::BlockGroup), "BlockGroup handlers don't match the schema");
+
+BlockGroup readBlockGroup(IO *blockGroup)
+{
+	BlockGroup group;
+	group.hasDuration = false;
+	group.duration = 0;
+	group.hasReference = false;
+	visitChildren(blockGroup, group, blockGroupHandlers);
+	return group;
+}
+
+// The optional Timecode of a Cluster, which comes before its blocks
+static uint64_t readClusterTimecode(EBMLElement &cluster)
+{
+	for (EBMLElementIterator it(cluster); it != EBMLElementIterator::end; ++it)
+		if (it->id == id::Timecode)
+			return readUint(it->size, &it->io);
+	return 0;
+}
+
+const int64_t ClusterInfo::noKeyframe;
+
+// A block we found, but did not read yet. It refers to its Cluster rather than
+// to any iterator, so it stays valid after the Cursor has moved on.
+struct Parser::BlockRef
+{
+	EBMLElement cluster;
+	uint64_t clusterTimecode;
+	uint64_t trackNumber;
+
+	// From the block header
+	int16_t timeOffset;
+	uint8_t flags;
+
+	// The remainder of the block after its header, relative to the Cluster
+	size_t offset;
+	size_t size;
+
+	// BlockGroups can specify a duration, and references to other blocks
+	bool isSimple;
+	bool hasDuration;
+	uint64_t duration;
+	bool hasReference;
+
+	// SimpleBlocks have a keyframe flag, Blocks are keyframes if they don't
+	// reference other blocks
+	bool isKeyframe() const
+	{
+		return isSimple ? (flags & 0x80) != 0 : !hasReference;
+	}
+
+	// In ticks, and before the Cluster's time if the offset is negative
+	int64_t getTimecode() const
+	{
+		return int64_t(clusterTimecode) + timeOffset;
+	}
+};
+
+// Our position in the Clusters of the Segment
+struct Parser::Cursor
+{
+	Cursor();
+
+	// Start over at the Cluster at position in io
+	void moveTo(IO *io, size_t position);
+
+	EBMLElementIterator clusterIt;
+	EBMLElementIterator blockIt;
+	bool firstCluster;
+
+	// Cluster info
+	uint64_t clusterTimecode;
+
+	// A block that could not be queued yet, in interleaved mode
+	bool hasPending;
+	BlockRef pending;
+};
+
+Parser::Cursor::Cursor()
+	: clusterIt(EBMLElementIterator::end)
+	, blockIt(EBMLElementIterator::end)
+	, firstCluster(true)
+	, clusterTimecode(0)
+	, hasPending(false)
+	, pending()
+{
+}
+
+void Parser::Cursor::moveTo(IO *io, size_t position)
+{
+	clusterIt = EBMLElementIterator(io, position);
+	blockIt = EBMLElementIterator::end;
+	firstCluster = true;
+	hasPending = false;
+}
+
+// One track's entry in a CuePoint
+struct Parser::CuePoint
+{
+	uint64_t trackNumber;
+	int64_t timecode;
+	size_t clusterPosition;
+
+	bool operator<(const CuePoint &other) const
+	{
+		if (trackNumber != other.trackNumber)
+			return trackNumber < other.trackNumber;
+		return timecode < other.timecode;
+	}
+};
+
+// A Cluster in the Cluster index
+struct Parser::ClusterEntry
+{
+	uint64_t timecode;
+	size_t position;
+
+	bool operator<(const ClusterEntry &other) const
+	{
+		return timecode < other.timecode;
+	}
+};
+
 struct Parser::StreamState
 {
 	StreamState();
@@ -79,52 +359,81 @@ struct Parser::StreamState
 	StreamState(const StreamState &other) = delete;
 	StreamState(StreamState &&other);
 
-	// Make sure the buffer is at least 'size' long
-	void grow(uint64_t size);
+	// Make sure the buffer is at least 'size' long. Returns whether it had
+	// to allocate a new one.
+	bool grow(uint64_t size);
 
-	// Our position in the file
-	EBMLElementIterator clusterIt;
-	EBMLElementIterator blockIt;
-	bool firstCluster;
+	// Fill laceOffsets from the current block
+	void readLaceSizes();
+
+	// Our position in the file, if not interleaved
+	Cursor cursor;
 
-	// Our grow-only per-stream buffer
+	// Blocks found for us by other streams, if interleaved
+	std::deque<BlockRef> queue;
+	bool selected;
+
+	// Our grow-only per-stream buffer, optionally from a pool. Packets can
+	// share its storage, in which case we get a new one for the next block.
+	PacketBuffer *storage;
 	uint8_t *buffer;
 	uint64_t bufferSize;
+	BufferPool *pool;
 
-	// Track info
-	float timecodeScale;
+	// The current block's data, either in our buffer or in the IO
+	const uint8_t *data;
 
-	// Cluster info
-	uint64_t clusterTimecode;
+	// Track info: nanoseconds per tick of its timecodes
+	int64_t timestampScale;
 
-	// Block info, saved because of lacing
-	uint64_t timecode;
+	// Block info, saved because of lacing. The timecode is in ticks, as the
+	// Cues have it, the timestamp and duration in nanoseconds.
+	int64_t timecode;
+	int64_t timestamp;
 	uint64_t duration;
+	bool keyframe;
+	bool invisible;
+	bool discardable;
+
+	// Whether timecode is where we are, which it isn't before the first
+	// block, or after moving
+	bool positionKnown;
+	// Whether the frames are still the CodecPrivate headers, which come
+	// before any block
+	bool headersPending;
 
 	// Our position in the block, for lacing
+	EBMLElement cluster;
 	EBMLElement block;
 	size_t blockSize;
 	ssize_t subpacketPos;
 	ssize_t subpackets;
 
-	enum {
-		LACING_NONE,
-		LACING_EBML,
-		LACING_XIPH,
-		LACING_FIXED,
-	} lacing;
+	// Where each subpacket starts in the data, and where the last one ends
+	std::vector<size_t> laceOffsets;
+
+	// The codec headers from CodecPrivate, for ParallelReader
+	std::vector<Packet> headers;
+
+	Lacing lacing;
 };
 
 Parser::StreamState::StreamState()
-	: clusterIt(EBMLElementIterator::end)
-	, blockIt(EBMLElementIterator::end)
-	, firstCluster(true)
+	: selected(true)
+	, storage(nullptr)
 	, buffer(nullptr)
 	, bufferSize(0)
-	, timecodeScale(1)
-	, clusterTimecode(0)
+	, pool(nullptr)
+	, data(nullptr)
+	, timestampScale(defaultTimecodeScale)
 	, timecode(0)
+	, timestamp(0)
 	, duration(0)
+	, keyframe(false)
+	, invisible(false)
+	, discardable(false)
+	, positionKnown(false)
+	, headersPending(false)
 	, blockSize(0)
 	, subpacketPos(1)
 	, subpackets(1)
@@ -133,123 +442,322 @@ Parser::StreamState::StreamState()
 }
 
 Parser::StreamState::StreamState(StreamState &&other)
-	: clusterIt(other.clusterIt)
-	, blockIt(other.blockIt)
-	, firstCluster(other.firstCluster)
+	: cursor(other.cursor)
+	, queue(std::move(other.queue))
+	, selected(other.selected)
+	, storage(other.storage)
 	, buffer(other.buffer)
 	, bufferSize(other.bufferSize)
-	, timecodeScale(other.timecodeScale)
-	, clusterTimecode(other.clusterTimecode)
+	, pool(other.pool)
+	, data(other.data)
+	, timestampScale(other.timestampScale)
 	, timecode(other.timecode)
+	, timestamp(other.timestamp)
 	, duration(other.duration)
+	, keyframe(other.keyframe)
+	, invisible(other.invisible)
+	, discardable(other.discardable)
+	, positionKnown(other.positionKnown)
+	, headersPending(other.headersPending)
 	, blockSize(other.blockSize)
 	, subpacketPos(other.subpacketPos)
 	, subpackets(other.subpackets)
+	, laceOffsets(std::move(other.laceOffsets))
+	, headers(std::move(other.headers))
 	, lacing(other.lacing)
 {
+	other.storage = nullptr;
 	other.buffer = nullptr;
 	other.bufferSize = 0;
 }
 
 Parser::StreamState::~StreamState()
 {
-	delete[] buffer;
+	if (storage)
+		storage->unref();
+}
+
+bool Parser::StreamState::grow(uint64_t size)
+{
+	// The buffer only ever grows, smaller blocks fit in it just fine. Unless
+	// Packets still use it, then we leave it to them.
+	if (storage && bufferSize >= size && !storage->isShared())
+		return false;
+
+	if (storage)
+	{
+		storage->unref();
+		storage = nullptr;
+	}
+
+	storage = PacketBuffer::create(size, pool);
+	buffer = storage->getData();
+	bufferSize = storage->getCapacity();
+	return true;
+}
+
+void Parser::StreamState::readLaceSizes()
+{
+	matryona::readLaceSizes(lacing, data, blockSize, subpackets, laceOffsets);
+}
+
+Parser::Parser(IO *input)
+	: input(input)
+	, interleaved(false)
+	, maxQueued(64)
+	, demux(new Cursor)
+	, seekHeadLoaded(false)
+	, cuesLoaded(false)
+	, clusterScanPos(0)
+	, clusterIndexComplete(false)
+{
+	readHeader();
+
+	// All cursors start at the top of the Segment, no need to read it again
+	// for each
+	EBMLElementIterator first(&segment.io);
+	demux->clusterIt = first;
+	for (StreamState &state : states)
+		state.cursor.clusterIt = first;
 }
 
-void Parser::StreamState::grow(uint64_t size)
+Parser::~Parser()
 {
-	if (bufferSize < size)
-		delete[] buffer;
-	buffer = new uint8_t[bufferSize = size];
+}
+
+size_t Parser::getNumStreams() const
+{
+	return streams.size();
+}
+
+const StreamInfo &Parser::getStreamInfo(size_t stream) const
+{
+	return streams[stream];
+}
+
+uint64_t Parser::getTimecodeScale() const
+{
+	return segmentInfo.timecodeScale;
+}
+
+int64_t Parser::getDuration() const
+{
+	if (!segmentInfo.hasDuration)
+		return -1;
+	return std::llround(segmentInfo.duration * segmentInfo.timecodeScale);
+}
+
+void Parser::setInterleaved(bool interleaved, size_t maxQueued)
+{
+	this->interleaved = interleaved;
+	this->maxQueued = maxQueued;
+}
+
+void Parser::setBufferPool(BufferPool *pool)
+{
+	for (StreamState &state : states)
+		state.pool = pool;
+}
+
+void Parser::selectStream(uint64_t stream, bool selected)
+{
+	std::lock_guard<std::mutex> lock(demuxMutex);
+	StreamState &state = states[stream];
+	state.selected = selected;
+	if (!selected)
+		state.queue.clear();
+}
+
+size_t Parser::findStream(uint64_t trackNumber) const
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+		if (streams[i].trackNumber == trackNumber)
+			return i;
+	return streams.size();
 }
 
 void Parser::readHeader()
 {
-	EBMLElement header = findElement(input, id::EBML);
+	EBMLElement headerElement = findElement(input, id::EBML);
+	std::vector<char> headerStorage;
+	MemIO header(loadElement(headerElement, headerStorage), headerElement.size);
 
-	// Check EBML version
+	checkEBMLHeader(&header);
+
+	// Find SegmentInfo and our various tracks, without looking at anything
+	// else in the Segment
+	segment = findElement(input, id::Segment);
+	EBMLElement infoElement;
+	if (findSegmentElement(id::SegmentInfo, infoElement))
 	{
-		EBMLElement readVersion = findElement(&header.io, id::EBMLReadVersion);
-		uint64_t version = readUint(readVersion.size, &readVersion.io);
-		if (version > 1)
-			throw InvalidFileFormatError("Invalid EBML version");
+		std::vector<char> infoStorage;
+		MemIO info(loadElement(infoElement, infoStorage), infoElement.size);
+		segmentInfo = readSegmentInfo(&info);
 	}
-
-	// Check if DocType is "matroska" or "webm"
+	else
 	{
-		EBMLElement docType = findElement(&header.io, id::DocType);
-		if (docType.size > 16)
-			throw InvalidFileFormatError("Format not recognized");
-		char buffer[16];
-		docType.io.read(buffer, docType.size);
-		if (std::strncmp(buffer, "matroska", docType.size) != 0 &&
-				std::strncmp(buffer, "webm", docType.size) != 0)
-			throw InvalidFileFormatError("Format not recognized");
+		segmentInfo.timecodeScale = defaultTimecodeScale;
+		segmentInfo.hasDuration = false;
+		segmentInfo.duration = 0;
 	}
 
-	// Find our various tracks
-	segment = findElement(input, id::Segment);
-	EBMLElement tracks = findElement(&segment.io, id::Tracks);
+	EBMLElement tracksElement;
+	if (!findSegmentElement(id::Tracks, tracksElement))
+		throw InvalidFileFormatError("Missing required element");
+	std::vector<char> tracksStorage;
+	MemIO tracks(loadElement(tracksElement, tracksStorage), tracksElement.size);
 
-	for (EBMLElementIterator it(&tracks.io); it != EBMLElementIterator::end; ++it)
+	for (EBMLElementIterator it(&tracks); it != EBMLElementIterator::end; ++it)
 	{
 		if (it->id != id::TrackEntry)
 			continue;
 
-		EBMLElement codecId = findElement(&it->io, id::CodecID);
-		EBMLElement trackUid = findElement(&it->io, id::TrackUID);
-		EBMLElement trackNumber = findElement(&it->io, id::TrackNumber);
+		TrackEntry entry = readTrackEntry(&it->io);
+		StreamState state;
+		state.timestampScale = trackTimestampScale(segmentInfo.timecodeScale, entry.timecodeScale);
+
+		if (entry.codecPrivate.size > 0 && entry.info.type == VIDEO_THEORA)
+		{
+			// Theora uses Xiph style lacing in the CodecPrivate field
+			// We can reuse the existing lacing code by pretending this is a block
+			// See readData and loadBlock for more info on lacing
+			EBMLElement &codecPrivate = entry.codecPrivate;
+			uint8_t frameCount;
+			if (codecPrivate.io.read(reinterpret_cast<char*>(&frameCount), 1) != 1)
+				throw IOError();
+
+			state.subpacketPos = 0;
+			state.subpackets = frameCount+1;
+
+			state.blockSize = codecPrivate.io.getLength() - codecPrivate.io.tell();
+			if (state.grow(state.blockSize))
+				bufferAllocations.add();
+			if (codecPrivate.io.read(reinterpret_cast<char*>(state.buffer), state.blockSize) != state.blockSize)
+				throw IOError();
+			state.data = state.buffer;
+
+			state.lacing = LACING_XIPH;
+			state.readLaceSizes();
+
+			for (ssize_t i = 0; i < state.subpackets; ++i)
+				state.headers.push_back(Packet(state.storage, state.data + state.laceOffsets[i], state.laceOffsets[i+1] - state.laceOffsets[i]));
+			state.headersPending = true;
+		}
 
-		StreamInfo info;
-		info.type = typeFromId(readUint(codecId.size, &codecId.io));
-		info.id = readUint(trackUid.size, &trackUid.io);
-		info.trackNumber = readUint(trackNumber.size, &trackNumber.io);
-		info.defaultDuration = 0;
-		info.isDefault = true;
-		info.isEnabled = true; 
+		streams.push_back(entry.info);
+		states.push_back(std::move(state));
+	}
+}
 
-		StreamState state;
-		state.clusterIt = EBMLElementIterator(&segment.io);
+bool Parser::readData(uint64_t stream, uint8_t *&data, uint64_t &size, int64_t &timestamp, uint64_t &duration)
+{
+	const uint8_t *frame;
+	if (!readData(stream, frame, size, timestamp, duration))
+		return false;
+
+	// If the block is not in our own buffer, it's a view into the IO, which
+	// we cannot hand out for writing. So copy the frame after all.
+	StreamState &state = states[stream];
+	if (state.data == state.buffer)
+	{
+		data = const_cast<uint8_t*>(frame);
+		return true;
+	}
+
+	if (state.grow(size))
+		bufferAllocations.add();
+	std::memcpy(state.buffer, frame, size);
+	data = state.buffer;
+	return true;
+}
 
-		// Handle optional data
-		for (EBMLElementIterator j(&it->io); j != EBMLElementIterator::end; ++j)
+Packet Parser::makePacket(const StreamState &state, size_t frame)
+{
+	// Share our buffer, unless the data is a view into the IO, which lives
+	// long enough on its own. The frames of a block share its storage.
+	PacketBuffer *storage = state.data == state.buffer ? state.storage : nullptr;
+	size_t start = state.laceOffsets[frame];
+	Packet packet(storage, state.data + start, state.laceOffsets[frame+1] - start);
+	packet.timestamp = state.timestamp;
+	packet.duration = state.duration;
+	packet.keyframe = state.keyframe;
+	packet.invisible = state.invisible;
+	packet.discardable = state.discardable;
+	frames.add();
+	bytesDelivered.add(packet.size);
+	return packet;
+}
+
+bool Parser::readPacket(uint64_t stream, Packet &packet)
+{
+	StreamState &state = states[stream];
+	if (state.subpacketPos >= state.subpackets)
+		if (!readBlock(stream))
+			return false;
+
+	packet = makePacket(state, state.subpacketPos);
+	++state.subpacketPos;
+	return true;
+}
+
+size_t Parser::readPackets(uint64_t stream, Packet *packets, size_t max)
+{
+	StreamState &state = states[stream];
+	size_t count = 0;
+	while (count < max)
+	{
+		if (state.subpacketPos >= state.subpackets)
 		{
-			if (j->id == id::FlagDefault)
-				info.isDefault = readUint(j->size, &j->io) == 1;
-			if (j->id == id::FlagEnabled)
-				info.isEnabled = readUint(j->size, &j->io) == 1;
-			if (j->id == id::DefaultDuration)
-				info.defaultDuration = readUint(j->size, &j->io);
-			if (j->id == id::TrackTimecodeScale)
-				state.timecodeScale = readFloat(j->size, &j->io);
-			if (j->id == id::CodecPrivate && info.type == VIDEO_THEORA)
+			// Hand out what we have before giving up on a full queue. The
+			// block is held on to, so the next call runs into it again.
+			try
+			{
+				if (!readBlock(stream))
+					break;
+			}
+			catch (QueueFullError &)
 			{
-				// Theora uses Xiph style lacing in the CodecPrivate field
-				// We can reuse the existing lacing code by pretending this is a block
-				// See readData and readBlock for more info on lacing
-				state.block = *j;
-				uint8_t frameCount;
-				if (state.block.io.read(reinterpret_cast<char*>(&frameCount), 1) != 1)
-					throw IOError();
-
-				state.subpacketPos = 0;
-				state.subpackets = frameCount+1;
-
-				state.blockSize = state.block.io.getLength() - state.block.io.tell();
-				state.grow(state.blockSize);
-				if (state.block.io.read(reinterpret_cast<char*>(state.buffer), state.blockSize) != state.blockSize)
-					throw IOError();
-
-				state.lacing = StreamState::LACING_XIPH;
+				if (count == 0)
+					throw;
+				break;
 			}
 		}
 
-		streams.push_back(info);
-		states.push_back(std::move(state));
+		for (; state.subpacketPos < state.subpackets && count < max; ++state.subpacketPos, ++count)
+			packets[count] = makePacket(state, state.subpacketPos);
+	}
+
+	return count;
+}
+
+bool Parser::readKeyframe(uint64_t stream, Packet &packet)
+{
+	StreamState &state = states[stream];
+
+	// The codec headers come first, as a decoder can't start without them.
+	// Then finish the frames of a laced keyframe.
+	if (state.subpacketPos < state.subpackets && (state.headersPending || state.keyframe))
+		return readPacket(stream, packet);
+
+	// If the Cues know of a later keyframe, jump straight to its Cluster,
+	// and skip whatever comes up to the last keyframe we read there
+	int64_t from = 0;
+	if (!interleaved && state.positionKnown)
+	{
+		size_t position;
+		if (findNextCue(stream, state.timecode, position))
+		{
+			from = state.timecode + 1;
+			moveTo(stream, position);
+		}
 	}
+
+	if (!readBlock(stream, true, from))
+		return false;
+	return readPacket(stream, packet);
 }
 
-bool Parser::readData(uint64_t stream, uint8_t *&data, uint64_t &size, uint64_t &timecode, uint64_t &duration)
+bool Parser::readData(uint64_t stream, const uint8_t *&data, uint64_t &size, int64_t &timestamp, uint64_t &duration)
 {
 	StreamState &state = states[stream];
 
@@ -260,184 +768,679 @@ bool Parser::readData(uint64_t stream, uint8_t *&data, uint64_t &size, uint64_t
 		if (!readBlock(stream))
 			return false;
 
-	// We know the timecode and duration, which is per-block
-	timecode = state.timecode;
+	// We know the timestamp and duration, which is per-block
+	timestamp = state.timestamp;
 	duration = state.duration;
 
-	switch(state.lacing)
+	// The subpacket positions were worked out when the block was read
+	data = state.data + state.laceOffsets[state.subpacketPos];
+	size = state.laceOffsets[state.subpacketPos+1] - state.laceOffsets[state.subpacketPos];
+
+	++state.subpacketPos;
+	frames.add();
+	bytesDelivered.add(size);
+	return true;
+}
+
+struct SeekFields
+{
+	uint64_t id;
+	uint64_t position;
+};
+
+static void readSeekId(SeekFields &seek, EBMLElement &element)
+{
+	// The SeekID is stored as a binary, but it is an element ID all the
+	// same, so read it as one
+	seek.id = readVint(&element.io);
+}
+
+static constexpr ElementHandler<SeekFields> seekHandlers[] =
+{
+	handler<SeekFields>(id::SeekID, TYPE_BINARY, readSeekId),
+	uintField<SeekFields, &SeekFields::position>(id::SeekPosition),
+};
+static_assert(matchesSchema(seekHandlers, id::Seek), "Seek handlers don't match the schema");
+
+void Parser::loadSeekHead()
+{
+	if (seekHeadLoaded)
+		return;
+	seekHeadLoaded = true;
+
+	// The SeekHead, if any, comes before the first Cluster
+	EBMLElementIterator it(&segment.io);
+	it.until(id::SeekHead, id::Cluster);
+	if (it == EBMLElementIterator::end || it->id != id::SeekHead)
+		return;
+
+	std::vector<char> storage;
+	MemIO entries(loadElement(*it, storage), it->size);
+	for (EBMLElementIterator seek(&entries); seek != EBMLElementIterator::end; ++seek)
 	{
-	case StreamState::LACING_NONE:
-		// No lacing means 1 block is 1 "datum", usually one frame
-		data = state.buffer;
-		size = state.blockSize;
-		break;
-	case StreamState::LACING_XIPH:
+		if (seek->id != id::Seek)
+			continue;
+
+		SeekFields fields;
+		visitChildren(&seek->io, fields, seekHandlers);
+		seekHead[fields.id] = fields.position;
+	}
+}
+
+bool Parser::findSegmentElement(uint64_t id, EBMLElement &element)
+{
+	// Jump straight to it if the SeekHead knows where it is, otherwise walk
+	// the Segment, which only has to read element headers. A SeekHead
+	// pointing nowhere sensible is no reason to give up yet.
+	loadSeekHead();
+	auto entry = seekHead.find(id);
+	if (entry != seekHead.end())
 	{
-		// Walk the size data until we got to our subpacket's size
-		// Keep track of the offset so far, that marks the start of the subpacket
-		uint64_t offset = 0;
-		uint8_t *readPtr = state.buffer;
-		for (ssize_t seen = 0; seen < state.subpacketPos && readPtr < state.buffer + state.bufferSize; ++readPtr)
+		try
 		{
-			uint8_t sz = *readPtr;
-			offset += sz;
-			if (sz < 255)
-				++seen;
+			EBMLElementIterator it(&segment.io, entry->second);
+			if (it != EBMLElementIterator::end && it->id == id)
+			{
+				element = *it;
+				return true;
+			}
 		}
+		catch (IOError &)
+		{
+		}
+	}
 
-		// If we hit the end, abort
-		if (readPtr >= state.buffer + state.bufferSize)
-			throw IOError();
+	EBMLElementIterator it(&segment.io);
+	it.until(id);
+	if (it == EBMLElementIterator::end)
+		return false;
+
+	element = *it;
+	return true;
+}
 
-		// If this is the last subpacket, the size is the remainder,
-		// otherwise, read one more xiph-style length for the size, then
-		// finish to advance readPtr
-		if (state.subpacketPos + 1 != state.subpackets)
+struct CueTrackPositionsFields
+{
+	uint64_t track;
+	uint64_t clusterPosition;
+};
+
+static constexpr ElementHandler<CueTrackPositionsFields> cueTrackPositionsHandlers[] =
+{
+	uintField<CueTrackPositionsFields, &CueTrackPositionsFields::track>(id::CueTrack),
+	uintField<CueTrackPositionsFields, &CueTrackPositionsFields::clusterPosition>(id::CueClusterPosition),
+};
+static_assert(matchesSchema(cueTrackPositionsHandlers, id::CueTrackPositions), "CueTrackPositions handlers don't match the schema");
+
+struct CuePointFields
+{
+	uint64_t time;
+	std::vector<CueTrackPositionsFields> positions;
+};
+
+static void readCueTrackPositions(CuePointFields &point, EBMLElement &element)
+{
+	CueTrackPositionsFields positions;
+	visitChildren(&element.io, positions, cueTrackPositionsHandlers);
+	point.positions.push_back(positions);
+}
+
+static constexpr ElementHandler<CuePointFields> cuePointHandlers[] =
+{
+	uintField<CuePointFields, &CuePointFields::time>(id::CueTime),
+	handler<CuePointFields>(id::CueTrackPositions, TYPE_MASTER, readCueTrackPositions),
+};
+static_assert(matchesSchema(cuePointHandlers, id::CuePoint), "CuePoint handlers don't match the schema");
+
+void Parser::loadCues()
+{
+	if (cuesLoaded)
+		return;
+	cuesLoaded = true;
+
+	EBMLElement element;
+	if (!findSegmentElement(id::Cues, element))
+		return;
+
+	std::vector<char> storage;
+	MemIO cues(loadElement(element, storage), element.size);
+	CuePointFields fields;
+	for (EBMLElementIterator point(&cues); point != EBMLElementIterator::end; ++point)
+	{
+		if (point->id != id::CuePoint)
+			continue;
+
+		// A CuePoint has one time, and positions for one or more tracks
+		fields.positions.clear();
+		visitChildren(&point->io, fields, cuePointHandlers);
+		for (CueTrackPositionsFields &positions : fields.positions)
 		{
-			size = 0;
-			for (; readPtr < state.buffer + state.bufferSize; ++readPtr)
-			{
-				uint8_t sz = *readPtr;
-				size += sz;
-				if (sz < 255)
-					break;
-			}
-			++readPtr;
-			for (ssize_t seen = state.subpacketPos + 1; seen < state.subpackets - 1 && readPtr < state.buffer + state.bufferSize; ++readPtr)
-				if (*readPtr < 255)
-					++seen;
+			CuePoint cue;
+			cue.trackNumber = positions.track;
+			cue.timecode = fields.time;
+			cue.clusterPosition = positions.clusterPosition;
+			cuePoints.push_back(cue);
 		}
-		else
-			size = state.bufferSize - (readPtr - state.buffer) - offset;
+	}
 
-		// Again, abort if we hit the end
-		if (readPtr >= state.buffer + state.bufferSize)
-			throw IOError();
+	std::sort(cuePoints.begin(), cuePoints.end());
+}
 
-		data = readPtr + offset;
+void Parser::extendClusterIndex(uint64_t timecode)
+{
+	// Walk the Segment from where we left off, until we're past timecode.
+	// We only read Cluster headers and Timecodes, the iterator skips the rest.
+	EBMLElementIterator it(&segment.io, clusterScanPos);
+	while (it != EBMLElementIterator::end)
+	{
+		if (it->id != id::Cluster)
+		{
+			++it;
+			continue;
+		}
 
-		// One last sanity check
-		if (data + size > state.buffer + state.bufferSize)
-			throw IOError();
+		ClusterEntry entry;
+		entry.position = it.getPosition();
+		entry.timecode = readClusterTimecode(*it);
+
+		// Timecodes should only go up, but don't trust that too much
+		if (!clusterIndex.empty() && entry.timecode < clusterIndex.back().timecode)
+			entry.timecode = clusterIndex.back().timecode;
+		clusterIndex.push_back(entry);
 
-		break;
+		// Moving on tells us where the Cluster ends, even if its size is
+		// unknown
+		++it;
+		clusterScanPos = it.getPosition();
+
+		if (entry.timecode > timecode)
+			return;
+	}
+
+	clusterIndexComplete = true;
+}
+
+void Parser::moveTo(uint64_t stream, size_t position)
+{
+	// Move, and forget about the block we were in
+	if (interleaved)
+	{
+		std::lock_guard<std::mutex> lock(demuxMutex);
+		demux->moveTo(&segment.io, position);
+		for (StreamState &state : states)
+		{
+			state.queue.clear();
+			state.subpacketPos = state.subpackets;
+			state.positionKnown = false;
+			state.headersPending = false;
+		}
 	}
-	case StreamState::LACING_EBML:
-		throw InvalidFileFormatError("File uses EBML lacing, which is not yet implemented");
-	case StreamState::LACING_FIXED:
-		// Fixed size lacing is also simple, all blocks are constant size
-		size = state.blockSize/state.subpackets;
-		data = state.buffer + state.subpacketPos * size;
-		break;
+	else
+	{
+		StreamState &state = states[stream];
+		state.cursor.moveTo(&segment.io, position);
+		state.subpacketPos = state.subpackets;
+		state.positionKnown = false;
+		state.headersPending = false;
 	}
+}
 
-	++state.subpacketPos;
+bool Parser::seek(uint64_t stream, int64_t timestamp)
+{
+	// The Cues and Clusters have their times in ticks, and nothing is
+	// before 0
+	uint64_t timecode = timestamp < 0 ? 0 : timestamp / segmentInfo.timecodeScale;
+	size_t position;
+	if (!findPosition(stream, timecode, position))
+		return false;
+
+	moveTo(stream, position);
 	return true;
 }
 
-bool Parser::readBlock(uint64_t stream)
+bool Parser::findPosition(uint64_t stream, uint64_t timecode, size_t &position)
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+	loadCues();
+
+	// Find the range of CuePoints for this track, then the last one at or
+	// before timecode. Before the first one, we just go to the first one.
+	CuePoint key;
+	key.trackNumber = streams[stream].trackNumber;
+	key.timecode = 0;
+	auto first = std::lower_bound(cuePoints.begin(), cuePoints.end(), key);
+	if (first != cuePoints.end() && first->trackNumber == key.trackNumber)
+	{
+		key.timecode = timecode;
+		auto last = std::upper_bound(first, cuePoints.end(), key);
+		if (last != first)
+			--last;
+
+		position = last->clusterPosition;
+		return true;
+	}
+
+	// No Cues, use the Cluster index instead, making sure it covers timecode
+	if (!clusterIndexComplete && (clusterIndex.empty() || clusterIndex.back().timecode <= timecode))
+		extendClusterIndex(timecode);
+	if (clusterIndex.empty())
+		return false;
+
+	ClusterEntry entry;
+	entry.timecode = timecode;
+	auto last = std::upper_bound(clusterIndex.begin(), clusterIndex.end(), entry);
+	if (last != clusterIndex.begin())
+		--last;
+
+	position = last->position;
+	return true;
+}
+
+bool Parser::findNextCue(uint64_t stream, int64_t after, size_t &position)
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+	loadCues();
+
+	CuePoint key;
+	key.trackNumber = streams[stream].trackNumber;
+	key.timecode = after;
+	auto next = std::upper_bound(cuePoints.begin(), cuePoints.end(), key);
+	if (next == cuePoints.end() || next->trackNumber != key.trackNumber)
+		return false;
+
+	position = next->clusterPosition;
+	return true;
+}
+
+// The Cluster index files are a magic, some values identifying the file it
+// belongs to, then the index itself, all in 64-bit big endian
+static const char clusterIndexMagic[8] = {'M', 'T', 'R', 'Y', 'C', 'I', 'D', 'X'};
+
+static bool writeIndexValue(std::FILE *f, uint64_t value)
+{
+	uint8_t buffer[8];
+	for (int i = 7; i >= 0; --i, value >>= 8)
+		buffer[i] = value & 0xFF;
+	return std::fwrite(buffer, 8, 1, f) == 1;
+}
+
+static bool readIndexValue(std::FILE *f, uint64_t &value)
+{
+	uint8_t buffer[8];
+	if (std::fread(buffer, 8, 1, f) != 1)
+		return false;
+	value = 0;
+	for (int i = 0; i < 8; ++i)
+		value = (value << 8) | buffer[i];
+	return true;
+}
+
+bool Parser::saveClusterIndex(const char *filename)
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+	std::FILE *f = std::fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	bool ok = std::fwrite(clusterIndexMagic, 8, 1, f) == 1;
+	ok = ok && writeIndexValue(f, input->getLength());
+	ok = ok && writeIndexValue(f, segment.size);
+	ok = ok && writeIndexValue(f, clusterScanPos);
+	ok = ok && writeIndexValue(f, clusterIndexComplete);
+	ok = ok && writeIndexValue(f, clusterIndex.size());
+	for (size_t i = 0; ok && i < clusterIndex.size(); ++i)
+	{
+		ok = writeIndexValue(f, clusterIndex[i].position);
+		ok = ok && writeIndexValue(f, clusterIndex[i].timecode);
+	}
+
+	return std::fclose(f) == 0 && ok;
+}
+
+bool Parser::loadClusterIndex(const char *filename)
+{
+	std::FILE *f = std::fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	// Check it belongs to this file, as far as we can tell
+	char magic[8];
+	uint64_t fileLength, segmentSize, scanPos, complete, count;
+	bool ok = std::fread(magic, 8, 1, f) == 1 && std::memcmp(magic, clusterIndexMagic, 8) == 0;
+	ok = ok && readIndexValue(f, fileLength) && fileLength == input->getLength();
+	ok = ok && readIndexValue(f, segmentSize) && segmentSize == segment.size;
+	ok = ok && readIndexValue(f, scanPos) && readIndexValue(f, complete);
+	ok = ok && readIndexValue(f, count) && scanPos <= segment.size;
+
+	std::vector<ClusterEntry> index;
+	for (uint64_t i = 0; ok && i < count; ++i)
+	{
+		ClusterEntry entry;
+		uint64_t position = 0;
+		ok = readIndexValue(f, position) && readIndexValue(f, entry.timecode);
+		entry.position = position;
+		ok = ok && entry.position < segment.size;
+		index.push_back(entry);
+	}
+
+	std::fclose(f);
+	if (!ok)
+		return false;
+
+	std::lock_guard<std::mutex> lock(indexMutex);
+	clusterIndex.swap(index);
+	clusterScanPos = scanPos;
+	clusterIndexComplete = complete != 0;
+	return true;
+}
+
+bool Parser::readClusterInfo(size_t &position, ClusterInfo &info)
+{
+	EBMLElementIterator it(&segment.io, position);
+	it.until(id::Cluster);
+	if (it == EBMLElementIterator::end)
+		return false;
+
+	info.timestamp = int64_t(readClusterTimecode(*it)) * int64_t(segmentInfo.timecodeScale);
+
+	// Moving on tells us where it ends, even if its size is unknown
+	size_t start = it.getPosition();
+	++it;
+	position = it.getPosition();
+	info.offset = segment.offset + start;
+	info.size = position - start;
+
+	// Find the first keyframes by the block headers, until we have them all
+	IOWindow window;
+	window.init(&segment.io, start, position - start);
+	Cursor cursor;
+	cursor.moveTo(&window, 0);
+	info.firstKeyframe.assign(streams.size(), ClusterInfo::noKeyframe);
+	size_t missing = streams.size();
+	BlockRef ref;
+	while (missing > 0 && nextBlock(cursor, ref))
+	{
+		size_t stream = findStream(ref.trackNumber);
+		if (stream >= streams.size() || !ref.isKeyframe() || info.firstKeyframe[stream] != ClusterInfo::noKeyframe)
+			continue;
+
+		info.firstKeyframe[stream] = ref.getTimecode() * states[stream].timestampScale;
+		--missing;
+	}
+
+	return true;
+}
+
+void Parser::copyClusters(const ClusterInfo &first, const ClusterInfo &last, OutputIO *output)
+{
+	size_t length = last.offset + last.size - first.offset;
+	if (last.offset < first.offset || output->copyFrom(input, first.offset, length) != length)
+		throw IOError();
+}
+
+ParserStats Parser::getStats() const
+{
+	ParserStats stats;
+	stats.blocks = blocks.get();
+	stats.blocksSkipped = blocksSkipped.get();
+	stats.frames = frames.get();
+	stats.bytesDelivered = bytesDelivered.get();
+	stats.bufferAllocations = bufferAllocations.get();
+	return stats;
+}
+
+bool Parser::readBlock(uint64_t stream, bool keyframes, int64_t from)
 {
 	StreamInfo &info = streams[stream];
 	StreamState &state = states[stream];
-	uint64_t trackNumber;
-	state.duration = info.defaultDuration;
+	BlockRef ref;
 
-	do
-	{
-		// Advance to the next block, either a BlockGroup or a SimpleBlock
-		++state.blockIt;
-		state.blockIt.until(id::BlockGroup, id::SimpleBlock);
+	// When we only want keyframes, we skip the other blocks by their header,
+	// without reading their data
+	auto skip = [&](const BlockRef &ref) {
+		return keyframes && (!ref.isKeyframe() || ref.getTimecode() < from);
+	};
 
-		// If there is no such block in this Cluster, go to the next cluster
-		while (state.blockIt == EBMLElementIterator::end)
+	if (!interleaved)
+	{
+		// Walk our own cursor, skipping the blocks of other streams
+		while (true)
 		{
-			// In case we haven't read this Cluster yet, do that first
-			if (!state.firstCluster)
-				++state.clusterIt;
-			state.firstCluster = false;
-			state.clusterIt.until(id::Cluster);
-
-			// If there are no more Clusters, we're done, no more blocks.
-			if (state.clusterIt == EBMLElementIterator::end)
+			if (!nextBlock(state.cursor, ref))
 				return false;
+			if (ref.trackNumber == info.trackNumber && !skip(ref))
+				break;
+			blocksSkipped.add();
+		}
 
-			// Initialise our blockIterator, in this new Cluster
-			state.blockIt = EBMLElementIterator(&state.clusterIt->io).until(id::BlockGroup, id::SimpleBlock);
+		loadBlock(stream, state, ref);
+		return true;
+	}
 
-			// Find the optional cluster TimeCode
-			state.clusterTimecode = 0;
-			for (EBMLElementIterator it(&state.clusterIt->io); it != EBMLElementIterator::end; ++it)
-				if (it->id == id::Timecode)
-				{
-					state.clusterTimecode = readUint(it->size, &it->io);
-					break;
-				}
+	// Another stream might have found our next block already
+	std::unique_lock<std::mutex> lock(demuxMutex);
+	while (!state.queue.empty())
+	{
+		ref = state.queue.front();
+		state.queue.pop_front();
+		if (skip(ref))
+		{
+			blocksSkipped.add();
+			continue;
+		}
+
+		lock.unlock();
+		loadBlock(stream, state, ref);
+		return true;
+	}
+
+	// Otherwise walk the shared cursor, queueing blocks for other streams
+	while (true)
+	{
+		if (demux->hasPending)
+		{
+			ref = demux->pending;
+			demux->hasPending = false;
 		}
+		else if (!nextBlock(*demux, ref))
+			return false;
 
-		// We have a new block, is it a SimpleBlock or a BlockGroup?
-		state.block = *state.blockIt;
-		if (state.block.id == id::BlockGroup)
+		size_t target = findStream(ref.trackNumber);
+		if (target == stream && !skip(ref))
+			break;
+		if (target == stream || target >= states.size() || !states[target].selected)
 		{
-			// If it's a BlockGroup we get its duration, then navigate to its Block
-			EBMLElement blockDuration = findElement(&state.block.io, id::BlockDuration);
-			state.duration = readUint(blockDuration.size, &blockDuration.io);
-			state.block = findElement(&state.blockIt->io, id::Block);
+			blocksSkipped.add();
+			continue;
 		}
 
-		// Read the track number of this block, if it doesn't match, try again
-		trackNumber = readVint(&state.block.io);
-	} while (trackNumber != info.trackNumber);
+		StreamState &other = states[target];
+		if (other.queue.size() >= maxQueued)
+		{
+			// Hold on to the block, so we can queue it once there is room
+			demux->pending = ref;
+			demux->hasPending = true;
+			throw QueueFullError(target);
+		}
+		other.queue.push_back(ref);
+	}
 
-	// We now have a Block! Read the time offset
-	int16_t timeOffset;
-	if (state.block.io.read(reinterpret_cast<char*>(&timeOffset), 2) != 2)
-		throw IOError();
-	// FIXME: Do this only if little endian
-	timeOffset = swapEndianness(timeOffset);
+	// Reading the block itself only involves us
+	lock.unlock();
+	loadBlock(stream, state, ref);
+	return true;
+}
 
-	// TODO: Figure out what to do with timecodeScale.
-	state.timecode = state.clusterTimecode + timeOffset;
+bool Parser::nextBlock(Cursor &cursor, BlockRef &ref)
+{
+	// Advance to the next block, either a BlockGroup or a SimpleBlock
+	++cursor.blockIt;
+	cursor.blockIt.until(id::BlockGroup, id::SimpleBlock);
 
-	// Read the flags
-	uint8_t flags;
-	if (state.block.io.read(reinterpret_cast<char*>(&flags), 1) != 1)
-		throw IOError();
+	// If there is no such block in this Cluster, go to the next cluster
+	while (cursor.blockIt == EBMLElementIterator::end)
+	{
+		// In case we haven't read this Cluster yet, do that first. If its
+		// size is unknown, we just found its end, so the iterator doesn't
+		// have to walk it again.
+		if (!cursor.firstCluster)
+		{
+			if (cursor.clusterIt->sizeUnknown)
+				cursor.clusterIt.setNext(cursor.clusterIt->offset + cursor.blockIt.getPosition());
+			++cursor.clusterIt;
+		}
+		cursor.firstCluster = false;
+		cursor.clusterIt.until(id::Cluster);
 
-	// Lacing, woo
-	switch ((flags & 0x06) >> 1)
-	{
-	case 0b00:
-		state.lacing = StreamState::LACING_NONE;
-		break;
-	case 0b01:
-		state.lacing = StreamState::LACING_XIPH;
-		break;
-	case 0b10:
-		state.lacing = StreamState::LACING_FIXED;
-		break;
-	case 0b11:
-		throw InvalidFileFormatError("File uses EBML lacing, which is not yet implemented");
-	default:
-		throw InvalidFileFormatError("Invalid lacing specified");
+		// If there are no more Clusters, we're done, no more blocks.
+		if (cursor.clusterIt == EBMLElementIterator::end)
+			return false;
+
+		// Initialise our blockIterator, in this new Cluster
+		cursor.blockIt = EBMLElementIterator(*cursor.clusterIt).until(id::BlockGroup, id::SimpleBlock);
+
+		cursor.clusterTimecode = readClusterTimecode(*cursor.clusterIt);
 	}
 
+	ref.cluster = *cursor.clusterIt;
+	ref.clusterTimecode = cursor.clusterTimecode;
+	ref.isSimple = true;
+	ref.hasDuration = false;
+	ref.hasReference = false;
+
+	// We have a new block, is it a SimpleBlock or a BlockGroup?
+	EBMLElement block = *cursor.blockIt;
+	size_t offset = block.offset;
+	if (block.id == id::BlockGroup)
+	{
+		// If it's a BlockGroup we get its optional duration and references,
+		// then navigate to its Block
+		BlockGroup group = readBlockGroup(&cursor.blockIt->io);
+		ref.isSimple = false;
+		ref.hasDuration = group.hasDuration;
+		ref.duration = group.duration;
+		ref.hasReference = group.hasReference;
+		block = group.block;
+		offset += block.offset;
+	}
+
+	// Read the block header in one go: the track number, time offset and
+	// flags. Then remember where the rest is.
+	uint8_t buffer[8 + 3];
+	size_t available = 0;
+	const uint8_t *header = reinterpret_cast<const uint8_t*>(block.io.view(0, available));
+	if (!header)
+	{
+		available = block.io.readAt(0, reinterpret_cast<char*>(buffer), sizeof(buffer));
+		header = buffer;
+	}
+
+	uint8_t length = decodeVint(header, available, ref.trackNumber);
+	if (length == 0 || available < length + 3u)
+		throw InvalidFileFormatError("Invalid block header");
+
+	ref.timeOffset = int16_t((header[length] << 8) | header[length+1]);
+	ref.flags = header[length+2];
+	ref.offset = offset + length + 3;
+	ref.size = block.size - length - 3;
+	blocks.add();
+	return true;
+}
+
+void Parser::loadBlock(uint64_t stream, StreamState &state, const BlockRef &ref)
+{
+	const StreamInfo &info = streams[stream];
+
+	state.cluster = ref.cluster;
+	state.block.io.init(&state.cluster.io, ref.offset, ref.size);
+
+	// We now have a Block! Its header was read when it was found. Its
+	// timecode and BlockDuration are in ticks, DefaultDuration is in
+	// nanoseconds already.
+	state.timecode = ref.getTimecode();
+	state.timestamp = state.timecode * state.timestampScale;
+	state.duration = ref.hasDuration ? ref.duration * state.timestampScale : info.defaultDuration;
+	state.positionKnown = true;
+	state.headersPending = false;
+
+	// Invisible frames are decoded but not shown, discardable ones can be
+	// dropped if we're in a hurry. SimpleBlocks only have the latter.
+	uint8_t flags = ref.flags;
+	state.keyframe = ref.isKeyframe();
+	state.invisible = (flags & 0x08) != 0;
+	state.discardable = ref.isSimple && (flags & 0x01) != 0;
+
+	// Lacing, woo
+	state.lacing = lacingFromFlags(flags);
+
 	// If there is any kind of lacing, we first get a frameCount (-1)
-	if (state.lacing != StreamState::LACING_NONE)
+	state.subpacketPos = 0;
+	state.subpackets = 1;
+	if (state.lacing != LACING_NONE)
 	{
 		uint8_t frameCount;
 		if (state.block.io.read(reinterpret_cast<char*>(&frameCount), 1) != 1)
 			throw IOError();
-		state.subpacketPos = 0;
 		state.subpackets = frameCount+1;
 	}
 
 	// Now the remainder is the actual data, possibly with laced subpacket sizes
+	// If the IO has it in memory we can use it in place, otherwise copy it
 	state.blockSize = state.block.io.getLength() - state.block.io.tell();
-	state.grow(state.blockSize);
-	if (state.block.io.read(reinterpret_cast<char*>(state.buffer), state.blockSize) != state.blockSize)
-		throw IOError();
+	size_t available = 0;
+	const char *view = state.block.io.view(state.block.io.tell(), available);
+	if (view && available >= state.blockSize)
+		state.data = reinterpret_cast<const uint8_t*>(view);
+	else
+	{
+		if (state.grow(state.blockSize))
+			bufferAllocations.add();
+		if (state.block.io.read(reinterpret_cast<char*>(state.buffer), state.blockSize) != state.blockSize)
+			throw IOError();
+		state.data = state.buffer;
+	}
 
-	return true;
+	// Work out where the subpackets are once, rather than on every read
+	state.readLaceSizes();
+}
+
+void Parser::readCodecHeaders(std::vector<std::pair<size_t, Packet>> &packets)
+{
+	for (size_t stream = 0; stream < states.size(); ++stream)
+		if (states[stream].selected)
+			for (const Packet &packet : states[stream].headers)
+				packets.push_back(std::make_pair(stream, packet));
+}
+
+void Parser::readCluster(size_t position, size_t end, std::vector<std::pair<size_t, Packet>> &packets)
+{
+	// Walk a window holding just this Cluster, so our Cursor stops at its end
+	IOWindow window;
+	window.init(&segment.io, position, end - position);
+	Cursor cursor;
+	cursor.moveTo(&window, 0);
+
+	// Our own states, so we don't touch those of the streams. As all frames
+	// are handed out as Packets, every block gets a new buffer anyway.
+	std::vector<StreamState> local(states.size());
+	BlockRef ref;
+	while (nextBlock(cursor, ref))
+	{
+		size_t stream = findStream(ref.trackNumber);
+		if (stream >= states.size() || !states[stream].selected)
+		{
+			blocksSkipped.add();
+			continue;
+		}
+
+		StreamState &state = local[stream];
+		state.pool = states[stream].pool;
+		state.timestampScale = states[stream].timestampScale;
+		loadBlock(stream, state, ref);
+
+		for (ssize_t i = 0; i < state.subpackets; ++i)
+			packets.push_back(std::make_pair(stream, makePacket(state, i)));
+	}
 }
 
 } // matryona
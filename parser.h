@@ -2,10 +2,18 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include "io.h"
 #include "ebml.h"
+#include "output.h"
+#include "packet.h"
+#include "pool.h"
 
 namespace matryona
 {
@@ -30,6 +38,73 @@ struct StreamInfo
 	bool isDefault;
 };
 
+// A Cluster as a whole, for passing it on without reading its frames
+struct ClusterInfo
+{
+	// Where it is in the file, header included, and its size
+	std::uint64_t offset;
+	std::uint64_t size;
+	// In nanoseconds, like Packet timestamps
+	std::int64_t timestamp;
+	// For each stream, the timestamp of its first keyframe in the Cluster,
+	// or noKeyframe if it has none
+	std::vector<std::int64_t> firstKeyframe;
+
+	static const std::int64_t noKeyframe = std::numeric_limits<std::int64_t>::min();
+};
+
+// Check an EBML header is one of a file we can read, throws an
+// InvalidFileFormatError if it's not
+void checkEBMLHeader(IO *header);
+// Read the StreamInfo from a TrackEntry
+StreamInfo readStreamInfo(IO *trackEntry);
+
+// Without a TimecodeScale, ticks are milliseconds
+const std::uint64_t defaultTimecodeScale = 1000000;
+
+// What we read from SegmentInfo
+struct SegmentInfo
+{
+	// Nanoseconds per tick of Cluster and block timecodes
+	std::uint64_t timecodeScale;
+	// In ticks, and only if hasDuration
+	bool hasDuration;
+	double duration;
+};
+SegmentInfo readSegmentInfo(IO *segmentInfo);
+
+// All we read from a TrackEntry, in one pass over it
+struct TrackEntry
+{
+	StreamInfo info;
+	float timecodeScale;
+	// Theora has its headers Xiph laced in here. Its size is 0 if there is
+	// none.
+	EBMLElement codecPrivate;
+};
+TrackEntry readTrackEntry(IO *trackEntry);
+
+// Nanoseconds per tick of a track's block timecodes. TrackTimecodeScale is a
+// float, so it's applied here once, and timestamps are then worked out in
+// integers.
+std::int64_t trackTimestampScale(std::uint64_t timecodeScale, float trackTimecodeScale);
+
+// What a BlockGroup has besides its Block
+struct BlockGroup
+{
+	EBMLElement block;
+	bool hasDuration;
+	std::uint64_t duration;
+	bool hasReference;
+};
+// Throws an InvalidFileFormatError if there is no Block
+BlockGroup readBlockGroup(IO *blockGroup);
+
+// Different streams can be read from different threads at once, if the IO's
+// readAt allows it. Each stream can only be used by one thread at a time, and
+// setting up (setInterleaved, selectStream, setBufferPool) has to happen
+// before any reading. In interleaved mode the streams share the Cluster walk,
+// which is done under a lock.
 class Parser
 {
 public:
@@ -39,18 +114,136 @@ public:
 	std::size_t getNumStreams() const;
 	const StreamInfo &getStreamInfo(std::size_t stream) const;
 
-	bool readData(std::uint64_t stream, std::uint8_t *&data, std::uint64_t &size, std::uint64_t &timecode, std::uint64_t &duration);
+	// In interleaved mode the Clusters are walked only once, and blocks for
+	// other streams are queued until those streams are read. At most
+	// maxQueued blocks are queued per stream, when that is exceeded a
+	// QueueFullError is thrown. Set this before reading any data.
+	void setInterleaved(bool interleaved, std::size_t maxQueued = 64);
+	// Blocks for streams that are not selected are skipped in interleaved mode
+	void selectStream(std::uint64_t stream, bool selected);
+
+	// Get the per-stream buffers from a pool, which has to outlive the Parser
+	// and any Packets it returned
+	void setBufferPool(BufferPool *pool);
+
+	// From SegmentInfo: nanoseconds per timecode tick, and the duration in
+	// nanoseconds, or -1 if the file doesn't say
+	std::uint64_t getTimecodeScale() const;
+	std::int64_t getDuration() const;
+
+	// Read the next frame of a stream. The data stays valid until the next
+	// read from the same stream. Timestamps and durations are in
+	// nanoseconds, see Packet.
+	bool readData(std::uint64_t stream, std::uint8_t *&data, std::uint64_t &size, std::int64_t &timestamp, std::uint64_t &duration);
+	// The same, but if the IO provides views (like MemIO and MmapIO) data
+	// points straight into it, instead of into a copy.
+	bool readData(std::uint64_t stream, const std::uint8_t *&data, std::uint64_t &size, std::int64_t &timestamp, std::uint64_t &duration);
+	// Read the next frame as a Packet, which keeps its data alive by itself,
+	// so it stays valid after further reads
+	bool readPacket(std::uint64_t stream, Packet &packet);
+	// Read up to max frames as Packets at once, all frames of a laced block
+	// in one go. Returns how many were read, which is less than max only at
+	// the end of the stream, or in interleaved mode when a queue is full.
+	// The QueueFullError then comes with the next call.
+	std::size_t readPackets(std::uint64_t stream, Packet *packets, std::size_t max);
+	// Read the next keyframe, skipping other blocks without reading their
+	// data. If the stream has Cues, and we're not interleaved, this jumps
+	// from one keyframe in the Cues to the next, passing by any others.
+	// Codec headers from CodecPrivate still come first, like readPacket.
+	bool readKeyframe(std::uint64_t stream, Packet &packet);
+
+	// Move a stream to the last keyframe at or before timestamp (in
+	// nanoseconds), according to the Cues. Without Cues for the stream, it
+	// moves to the last Cluster starting at or before timestamp instead,
+	// which might not start with a keyframe. In interleaved mode all streams
+	// move along, so no other stream can be read while seeking. Returns false
+	// if there is nowhere to go.
+	bool seek(std::uint64_t stream, std::int64_t timestamp);
+
+	// The Cluster index used for seeking without Cues is built as needed.
+	// It can be stored next to the file, so it doesn't have to be built
+	// again next time. Loading fails if the index belongs to another file.
+	bool saveClusterIndex(const char *filename);
+	bool loadClusterIndex(const char *filename);
+
+	// Walk the Clusters without reading any frames, only the headers of their
+	// blocks. Start with position 0, each call moves it past the Cluster it
+	// found. Returns false when there are no more.
+	bool readClusterInfo(std::size_t &position, ClusterInfo &info);
+	// Copy the Clusters from first to last to output, as they are in the
+	// file. Throws an IOError if not all of it could be copied.
+	void copyClusters(const ClusterInfo &first, const ClusterInfo &last, OutputIO *output);
+
+	// What we did so far, if built with MATRYONA_STATS. What that took from
+	// the IO is in its own getIOStats.
+	ParserStats getStats() const;
 
 private:
+	friend class ParallelReader;
+
+	struct Cursor;
+	struct BlockRef;
 	struct StreamState;
+	struct CuePoint;
+	struct ClusterEntry;
 
 	IO *input;
 	std::vector<StreamInfo> streams;
 	std::vector<StreamState> states;
 	EBMLElement segment;
+	SegmentInfo segmentInfo;
+
+	bool interleaved;
+	std::size_t maxQueued;
+	std::unique_ptr<Cursor> demux;
+	// Guards demux and the queues, in interleaved mode
+	std::mutex demuxMutex;
+
+	// Guards the SeekHead, Cues and Cluster index, which any stream can load
+	std::mutex indexMutex;
+
+	// Loaded when opening, maps element IDs to their position in the Segment
+	bool seekHeadLoaded;
+	std::map<std::uint64_t, std::size_t> seekHead;
+
+	// Loaded on first use, sorted by track number, then time
+	bool cuesLoaded;
+	std::vector<CuePoint> cuePoints;
+
+	// Built on demand by walking Clusters, clusterScanPos is where to continue
+	std::vector<ClusterEntry> clusterIndex;
+	std::size_t clusterScanPos;
+	bool clusterIndexComplete;
+
+	// See ParserStats
+	Counter<> blocks;
+	Counter<> blocksSkipped;
+	Counter<> frames;
+	Counter<> bytesDelivered;
+	Counter<> bufferAllocations;
 
 	void readHeader();
-	bool readBlock(std::uint64_t stream);
+	void loadSeekHead();
+	// Find a top-level element in the Segment, using the SeekHead if we can
+	bool findSegmentElement(std::uint64_t id, EBMLElement &element);
+	void loadCues();
+	void extendClusterIndex(std::uint64_t timecode);
+	bool findPosition(std::uint64_t stream, std::uint64_t timecode, std::size_t &position);
+	// Find the first CuePoint for a stream after a timecode
+	bool findNextCue(std::uint64_t stream, std::int64_t after, std::size_t &position);
+	void moveTo(std::uint64_t stream, std::size_t position);
+	bool readBlock(std::uint64_t stream, bool keyframes = false, std::int64_t from = 0);
+	bool nextBlock(Cursor &cursor, BlockRef &ref);
+	void loadBlock(std::uint64_t stream, StreamState &state, const BlockRef &ref);
+	// A frame of the loaded block as a Packet, sharing our buffer if it's in
+	// there, with the block's info
+	Packet makePacket(const StreamState &state, std::size_t frame);
+	// Get the codec headers that come before the first Cluster's frames
+	void readCodecHeaders(std::vector<std::pair<std::size_t, Packet>> &packets);
+	// Read all frames in the Cluster from position to end in the Segment,
+	// with their streams, independent of the streams' own positions
+	void readCluster(std::size_t position, std::size_t end, std::vector<std::pair<std::size_t, Packet>> &packets);
+	std::size_t findStream(std::uint64_t trackNumber) const;
 };
 
 } // matryona
@@ -0,0 +1,86 @@
+#include "pool.h"
+
+using std::size_t;
+using std::uint8_t;
+
+namespace matryona
+{
+
+// The smallest size class is 1 << minShift bytes
+static const size_t minShift = 8;
+
+static size_t sizeClass(size_t size)
+{
+	size_t index = 0;
+	while ((size_t(1) << (minShift + index)) < size)
+		++index;
+	return index;
+}
+
+BufferPool::BufferPool(size_t maxFree)
+	: maxFree(maxFree)
+	, stats()
+{
+}
+
+BufferPool::~BufferPool()
+{
+	for (auto &free : classes)
+		for (uint8_t *buffer : free)
+			delete[] buffer;
+}
+
+uint8_t *BufferPool::acquire(size_t size, size_t &capacity)
+{
+	size_t index = sizeClass(size);
+	capacity = size_t(1) << (minShift + index);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (index < classes.size() && !classes[index].empty())
+		{
+			uint8_t *buffer = classes[index].back();
+			classes[index].pop_back();
+			++stats.hits;
+			return buffer;
+		}
+		++stats.misses;
+	}
+
+	return new uint8_t[capacity];
+}
+
+void BufferPool::release(uint8_t *buffer, size_t capacity)
+{
+	if (!buffer)
+		return;
+
+	// Buffers that don't match a size class exactly did not come from us,
+	// so they can't go back in
+	size_t index = sizeClass(capacity);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (capacity == size_t(1) << (minShift + index))
+		{
+			if (index >= classes.size())
+				classes.resize(index + 1);
+			if (classes[index].size() < maxFree)
+			{
+				classes[index].push_back(buffer);
+				++stats.releases;
+				return;
+			}
+		}
+		++stats.discards;
+	}
+
+	delete[] buffer;
+}
+
+BufferPool::Stats BufferPool::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+} // matryona
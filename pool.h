@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace matryona
+{
+
+// A pool of reusable buffers, in power-of-two size classes. A Parser can get
+// its buffers from one, and so can its users. It can be shared between
+// threads.
+class BufferPool
+{
+public:
+	struct Stats
+	{
+		// Buffers handed out from the pool, and newly allocated
+		std::uint64_t hits;
+		std::uint64_t misses;
+		// Buffers given back and kept, and given back and freed
+		std::uint64_t releases;
+		std::uint64_t discards;
+	};
+
+	// At most maxFree unused buffers are kept per size class
+	BufferPool(std::size_t maxFree = 16);
+	~BufferPool();
+	BufferPool(const BufferPool &other) = delete;
+
+	// Get a buffer of at least size bytes, capacity is set to its actual size
+	std::uint8_t *acquire(std::size_t size, std::size_t &capacity);
+	// Give back a buffer, with the capacity acquire gave
+	void release(std::uint8_t *buffer, std::size_t capacity);
+
+	Stats getStats() const;
+
+private:
+	std::size_t maxFree;
+	std::vector<std::vector<std::uint8_t*>> classes;
+	Stats stats;
+	mutable std::mutex mutex;
+};
+
+} // matryona
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cstring>
+
+#include "errors.h"
+#include "prefetch.h"
+
+using std::size_t;
+
+namespace matryona
+{
+
+PrefetchIO::PrefetchIO(IO *parent, size_t depth, size_t chunkSize)
+	: parent(parent)
+	, length(parent->getLength())
+	, pos(0)
+	, depth(std::max<size_t>(depth, 1))
+	, chunkSize(std::max<size_t>(chunkSize, 1))
+	, readIndex(0)
+	, stopping(false)
+	, stats()
+{
+	producer = std::thread(&PrefetchIO::produce, this);
+}
+
+PrefetchIO::~PrefetchIO()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wanted.notify_all();
+	producer.join();
+}
+
+PrefetchIO::Chunk *PrefetchIO::find(size_t index)
+{
+	for (Chunk &chunk : chunks)
+		if (chunk.index == index)
+			return &chunk;
+	return nullptr;
+}
+
+void PrefetchIO::produce()
+{
+	size_t count = (length + chunkSize - 1) / chunkSize;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping)
+	{
+		// Find the first chunk we don't have yet, from where the reader is
+		size_t end = std::min(readIndex + depth, count);
+		size_t next = end;
+		for (size_t i = readIndex; i < end; ++i)
+			if (!find(i))
+			{
+				next = i;
+				break;
+			}
+
+		if (next == end)
+		{
+			wanted.wait(lock);
+			continue;
+		}
+
+		// Make room by dropping a chunk the reader is past, or too far ahead
+		// of. There is always one, as the missing chunk is in the window.
+		Chunk *slot = nullptr;
+		if (chunks.size() >= depth)
+		{
+			for (Chunk &chunk : chunks)
+			{
+				if (chunk.index >= readIndex && chunk.index < end)
+					continue;
+				if (!slot || chunk.index < slot->index)
+					slot = &chunk;
+			}
+		}
+		else
+		{
+			chunks.push_back(Chunk());
+			slot = &chunks.back();
+		}
+
+		slot->index = next;
+		slot->ready = false;
+		slot->error = nullptr;
+		slot->data.resize(std::min(chunkSize, length - next*chunkSize));
+
+		// Readers leave chunks that are not ready alone, so we can fill
+		// it without holding the lock. A short read is tried again from
+		// where it stopped, only running out of data is an error. Errors
+		// are the reader's to throw, we're on our own thread.
+		lock.unlock();
+		try
+		{
+			size_t done = 0;
+			while (done < slot->data.size())
+			{
+				size_t read = parent->readAt(next*chunkSize + done, slot->data.data() + done, slot->data.size() - done);
+				if (read == 0)
+					throw IOError();
+				done += read;
+			}
+		}
+		catch (...)
+		{
+			slot->error = std::current_exception();
+		}
+		lock.lock();
+
+		slot->ready = true;
+		if (!slot->error)
+			++stats.chunks;
+		loaded.notify_all();
+	}
+}
+
+size_t PrefetchIO::readAt(size_t position, char *buffer, size_t length)
+{
+	if (position >= this->length)
+		return 0;
+	if (position + length > this->length)
+		length = this->length - position;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	size_t done = 0;
+	while (done < length)
+	{
+		size_t index = (position + done) / chunkSize;
+		Chunk *chunk = find(index);
+		if (chunk && chunk->ready)
+			++stats.hits;
+		else
+			++stats.stalls;
+
+		// Point the producer here, and wait for it if it's not there yet
+		while (true)
+		{
+			if (readIndex != index)
+			{
+				readIndex = index;
+				wanted.notify_one();
+			}
+			if (chunk && chunk->ready)
+				break;
+
+			loaded.wait(lock);
+			chunk = find(index);
+		}
+
+		// Drop a chunk that failed, so it is read again next time
+		if (chunk->error)
+		{
+			std::exception_ptr error = chunk->error;
+			chunks.remove_if([chunk](const Chunk &other) { return &other == chunk; });
+			wanted.notify_one();
+			std::rethrow_exception(error);
+		}
+
+		size_t offset = position + done - index*chunkSize;
+		if (offset >= chunk->data.size())
+			break;
+
+		size_t amount = std::min(length - done, chunk->data.size() - offset);
+		std::memcpy(buffer + done, chunk->data.data() + offset, amount);
+		done += amount;
+	}
+
+	countRead(done);
+	return done;
+}
+
+size_t PrefetchIO::read(char *buffer, size_t length)
+{
+	size_t read = readAt(pos, buffer, length);
+	pos += read;
+	return read;
+}
+
+bool PrefetchIO::seek(size_t position)
+{
+	countSeek();
+	if (position >= length)
+		return false;
+	pos = position;
+	return true;
+}
+
+size_t PrefetchIO::tell()
+{
+	return pos;
+}
+
+size_t PrefetchIO::getLength()
+{
+	return length;
+}
+
+PrefetchIO::Stats PrefetchIO::getStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+} // matryona
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "io.h"
+
+namespace matryona
+{
+
+// PrefetchIO wraps another IO, and reads ahead of its reader on a thread of
+// its own. The file is read in chunks, and the depth chunks from the one last
+// read on are kept in memory, so at most depth*chunkSize bytes. That covers
+// the next few Clusters, which are then ready by the time the Parser gets to
+// them. It works best for reading front to back, like in interleaved mode.
+// Reads can come from several threads, but the parent is only ever read from
+// our own thread. Errors reading the parent are thrown from readAt.
+class PrefetchIO : public IO
+{
+public:
+	struct Stats
+	{
+		// Chunk reads that were ready, and that had to wait for the parent
+		std::uint64_t hits;
+		std::uint64_t stalls;
+		// Chunks read from the parent
+		std::uint64_t chunks;
+	};
+
+	PrefetchIO(IO *parent, std::size_t depth = 8, std::size_t chunkSize = 1024*1024);
+	~PrefetchIO();
+	PrefetchIO(const PrefetchIO &other) = delete;
+
+	std::size_t read(char *buffer, std::size_t length);
+	bool seek(std::size_t position);
+	std::size_t tell();
+	std::size_t getLength();
+	std::size_t readAt(std::size_t position, char *buffer, std::size_t length);
+
+	Stats getStats();
+
+private:
+	struct Chunk
+	{
+		std::size_t index;
+		std::vector<char> data;
+		bool ready;
+		// What the parent threw, or an IOError if it ran out of data, for
+		// readAt to throw in its place
+		std::exception_ptr error;
+	};
+
+	IO *parent;
+	std::size_t length;
+	std::size_t pos;
+	std::size_t depth;
+	std::size_t chunkSize;
+
+	std::mutex mutex;
+	// Signalled when the reader moved on, or we're stopping
+	std::condition_variable wanted;
+	// Signalled when a chunk is ready
+	std::condition_variable loaded;
+	std::list<Chunk> chunks;
+	// The chunk last read, where reading ahead starts
+	std::size_t readIndex;
+	bool stopping;
+	Stats stats;
+
+	std::thread producer;
+
+	Chunk *find(std::size_t index);
+	void produce();
+};
+
+} // matryona
@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <cstring>
+
+#include "lacing.h"
+#include "push.h"
+
+using std::size_t;
+using std::int64_t;
+using std::uint64_t;
+using std::uint8_t;
+
+namespace matryona
+{
+
+PushParser::PushParser(size_t maxBuffered, size_t maxQueued, BufferPool *pool)
+	: maxBuffered(std::max<size_t>(maxBuffered, 16))
+	, maxQueued(std::max<size_t>(maxQueued, 1))
+	, pool(pool)
+	, start(0)
+	, position(0)
+	, skipping(0)
+	, headerSeen(false)
+	, timecodeScale(defaultTimecodeScale)
+	, clusterTimecode(0)
+{
+}
+
+size_t PushParser::feed(const uint8_t *data, size_t length)
+{
+	size_t taken = 0;
+	while (taken < length && queue.size() < maxQueued)
+	{
+		// What we skip doesn't have to go through the buffer
+		if (skipping && start == buffer.size())
+		{
+			size_t amount = std::min<uint64_t>(skipping, length - taken);
+			skipping -= amount;
+			position += amount;
+			taken += amount;
+			continue;
+		}
+
+		// Move what's left to the front once we're through half the buffer,
+		// so an element coming in slowly isn't moved on every feed
+		if (start > 0 && start >= buffer.size() / 2)
+		{
+			buffer.erase(buffer.begin(), buffer.begin() + start);
+			start = 0;
+		}
+
+		size_t room = maxBuffered - (buffer.size() - start);
+		if (room == 0)
+			break;
+
+		size_t amount = std::min(room, length - taken);
+		buffer.insert(buffer.end(), data + taken, data + taken + amount);
+		taken += amount;
+		parse();
+	}
+
+	return taken;
+}
+
+size_t PushParser::getNumStreams() const
+{
+	return streams.size();
+}
+
+const StreamInfo &PushParser::getStreamInfo(size_t stream) const
+{
+	return streams[stream];
+}
+
+bool PushParser::readPacket(size_t &stream, Packet &packet)
+{
+	// We might have stopped parsing because the queue was full
+	if (queue.empty())
+		parse();
+	if (queue.empty())
+		return false;
+
+	stream = queue.front().first;
+	packet = std::move(queue.front().second);
+	queue.pop_front();
+	return true;
+}
+
+void PushParser::consume(size_t length)
+{
+	start += length;
+	position += length;
+}
+
+void PushParser::parse()
+{
+	while (queue.size() < maxQueued)
+	{
+		// Leave the elements we're at the end of
+		while (!levels.empty() && !levels.back().unknownSize && position >= levels.back().end)
+			levels.pop_back();
+
+		size_t available = buffer.size() - start;
+		if (skipping)
+		{
+			size_t amount = std::min<uint64_t>(skipping, available);
+			consume(amount);
+			skipping -= amount;
+			if (skipping)
+				return;
+			continue;
+		}
+
+		// Read the next element header, once we have all of it
+		const uint8_t *data = buffer.data() + start;
+		uint64_t element, size;
+		uint8_t idLength = decodeVint(data, available, element);
+		uint8_t sizeLength = idLength ? decodeVint(data + idLength, available - idLength, size) : 0;
+		if (sizeLength == 0)
+		{
+			// Either it's not all there yet, or it's not a valid header
+			if ((available > 0 && vintLength(data[0]) == 0) ||
+					(idLength && available > idLength && vintLength(data[idLength]) == 0))
+				throw InvalidFileFormatError("Invalid element header");
+			return;
+		}
+
+		size_t headerLength = idLength + sizeLength;
+		bool unknownSize = size == (uint64_t(1) << (7*sizeLength)) - 1;
+
+		while (!levels.empty() && levels.back().unknownSize && endsUnknownSize(levels.back().id, element))
+			levels.pop_back();
+
+		// Go into the Segment and its Clusters, their other elements come
+		// by one by one
+		uint64_t parent = levels.empty() ? 0 : levels.back().id;
+		if ((parent == 0 && element == id::Segment) || (parent == id::Segment && element == id::Cluster))
+		{
+			if (!headerSeen)
+				throw InvalidFileFormatError("Format not recognized");
+
+			Level level;
+			level.id = element;
+			level.unknownSize = unknownSize;
+			level.end = position + headerLength + size;
+			levels.push_back(level);
+			consume(headerLength);
+
+			if (element == id::Cluster)
+				clusterTimecode = 0;
+			continue;
+		}
+
+		if (unknownSize)
+			throw InvalidFileFormatError("Invalid unknown size");
+
+		// Skip what we don't need
+		bool wanted = (parent == 0 && element == id::EBML) ||
+			(parent == id::Segment && (element == id::SegmentInfo || element == id::Tracks)) ||
+			(parent == id::Cluster && (element == id::Timecode || element == id::SimpleBlock || element == id::BlockGroup));
+		if (!wanted)
+		{
+			consume(headerLength);
+			skipping = size;
+			continue;
+		}
+
+		// And wait for the rest of what we do need
+		if (headerLength + size > maxBuffered)
+			throw InvalidFileFormatError("Element too large to buffer");
+		if (available < headerLength + size)
+			return;
+
+		readElement(element, data + headerLength, size);
+		consume(headerLength + size);
+	}
+}
+
+void PushParser::readElement(uint64_t element, const uint8_t *data, size_t size)
+{
+	MemIO io(reinterpret_cast<const char*>(data), size);
+	switch (element)
+	{
+	case id::EBML:
+		checkEBMLHeader(&io);
+		headerSeen = true;
+		break;
+	case id::SegmentInfo:
+		timecodeScale = readSegmentInfo(&io).timecodeScale;
+		for (size_t i = 0; i < streams.size(); ++i)
+			timestampScales[i] = trackTimestampScale(timecodeScale, trackTimecodeScales[i]);
+		break;
+	case id::Tracks:
+		readTracks(data, size);
+		break;
+	case id::Timecode:
+		clusterTimecode = readUint(size, &io);
+		break;
+	case id::SimpleBlock:
+		readBlock(data, size, true, false, 0, false);
+		break;
+	case id::BlockGroup:
+		{
+			BlockGroup group = readBlockGroup(&io);
+			readBlock(data + group.block.offset, group.block.size, false, group.hasDuration, group.duration, group.hasReference);
+		}
+		break;
+	}
+}
+
+void PushParser::readTracks(const uint8_t *data, size_t size)
+{
+	MemIO io(reinterpret_cast<const char*>(data), size);
+	streams.clear();
+	timestampScales.clear();
+	trackTimecodeScales.clear();
+	for (EBMLElementIterator it(&io); it != EBMLElementIterator::end; ++it)
+	{
+		if (it->id != id::TrackEntry)
+			continue;
+
+		size_t stream = streams.size();
+		TrackEntry entry = readTrackEntry(&it->io);
+		streams.push_back(entry.info);
+		timestampScales.push_back(trackTimestampScale(timecodeScale, entry.timecodeScale));
+		trackTimecodeScales.push_back(entry.timecodeScale);
+
+		// Theora has its headers Xiph laced in CodecPrivate, they come
+		// before the frames
+		if (entry.info.type == VIDEO_THEORA && entry.codecPrivate.size >= 1)
+		{
+			const uint8_t *codecPrivate = data + it->offset + entry.codecPrivate.offset;
+			size_t frames = codecPrivate[0] + 1;
+			size_t length = entry.codecPrivate.size - 1;
+
+			PacketBuffer *storage = PacketBuffer::create(length, pool);
+			Packet headers(storage, storage->getData(), length);
+			storage->unref();
+			std::memcpy(storage->getData(), codecPrivate + 1, length);
+
+			readLaceSizes(LACING_XIPH, headers.data, length, frames, laceOffsets);
+			for (size_t i = 0; i < frames; ++i)
+			{
+				Packet packet(storage, headers.data + laceOffsets[i], laceOffsets[i+1] - laceOffsets[i]);
+				queue.push_back(std::make_pair(stream, std::move(packet)));
+			}
+		}
+	}
+}
+
+void PushParser::readBlock(const uint8_t *data, size_t size, bool isSimple, bool hasDuration, uint64_t duration, bool hasReference)
+{
+	// The header: track number, time offset and flags
+	uint64_t trackNumber;
+	uint8_t length = decodeVint(data, size, trackNumber);
+	if (length == 0 || size < length + 3u)
+		throw InvalidFileFormatError("Invalid block header");
+
+	size_t stream = findStream(trackNumber);
+	if (stream >= streams.size())
+		return;
+
+	int16_t timeOffset = int16_t((data[length] << 8) | data[length+1]);
+	uint8_t flags = data[length+2];
+	size_t pos = length + 3;
+
+	Lacing lacing = lacingFromFlags(flags);
+	size_t frames = 1;
+	if (lacing != LACING_NONE)
+	{
+		if (pos >= size)
+			throw InvalidFileFormatError("Invalid block header");
+		frames = data[pos++] + 1;
+	}
+
+	// Our buffer moves on, so the frames get their own
+	size_t blockSize = size - pos;
+	PacketBuffer *storage = PacketBuffer::create(blockSize, pool);
+	Packet block(storage, storage->getData(), blockSize);
+	storage->unref();
+	std::memcpy(storage->getData(), data + pos, blockSize);
+
+	// Timecodes and BlockDuration are in ticks, DefaultDuration is in
+	// nanoseconds already
+	int64_t scale = timestampScales[stream];
+	int64_t timestamp = (int64_t(clusterTimecode) + timeOffset) * scale;
+	uint64_t frameDuration = hasDuration ? duration * scale : streams[stream].defaultDuration;
+
+	readLaceSizes(lacing, block.data, blockSize, frames, laceOffsets);
+	for (size_t i = 0; i < frames; ++i)
+	{
+		Packet packet(storage, block.data + laceOffsets[i], laceOffsets[i+1] - laceOffsets[i]);
+		packet.timestamp = timestamp;
+		packet.duration = frameDuration;
+		packet.keyframe = isSimple ? (flags & 0x80) != 0 : !hasReference;
+		packet.invisible = (flags & 0x08) != 0;
+		packet.discardable = isSimple && (flags & 0x01) != 0;
+		queue.push_back(std::make_pair(stream, std::move(packet)));
+	}
+}
+
+size_t PushParser::findStream(uint64_t trackNumber) const
+{
+	for (size_t i = 0; i < streams.size(); ++i)
+		if (streams[i].trackNumber == trackNumber)
+			return i;
+	return streams.size();
+}
+
+} // matryona
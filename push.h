@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "packet.h"
+#include "parser.h"
+#include "pool.h"
+
+namespace matryona
+{
+
+// PushParser is fed a file in chunks, as they come in from a pipe, socket or
+// live stream, rather than reading it from an IO. It never seeks, and handles
+// Segments and Clusters of unknown size. Frames come out as soon as their
+// block is complete, in file order.
+//
+// Only elements we need whole (the EBML header, SegmentInfo, Tracks, and
+// blocks) are buffered, at most maxBuffered bytes of them. Everything else is
+// skipped as it passes by. Parsing pauses when maxQueued frames are waiting
+// to be read, at which point feed takes no more data. Frames get their
+// timestamps in nanoseconds like the Parser's, with SegmentInfo's
+// TimecodeScale if it came by before them.
+class PushParser
+{
+public:
+	PushParser(std::size_t maxBuffered = 16*1024*1024, std::size_t maxQueued = 256, BufferPool *pool = nullptr);
+
+	// Give us the next bytes of the file. Returns how many we took, which is
+	// less than length if our buffer or queue is full, so read some frames
+	// and feed the rest after. Throws an InvalidFileFormatError if an element
+	// we need whole is larger than maxBuffered.
+	std::size_t feed(const std::uint8_t *data, std::size_t length);
+
+	// The streams are known once Tracks has been fed
+	std::size_t getNumStreams() const;
+	const StreamInfo &getStreamInfo(std::size_t stream) const;
+
+	// Get the next frame of any stream. Returns false if we need more data.
+	bool readPacket(std::size_t &stream, Packet &packet);
+
+private:
+	// A master element we're in
+	struct Level
+	{
+		std::uint64_t id;
+		bool unknownSize;
+		// Where it ends in the file, if we know
+		std::uint64_t end;
+	};
+
+	std::size_t maxBuffered;
+	std::size_t maxQueued;
+	BufferPool *pool;
+
+	// What has been fed, but not parsed, from start on. position is where
+	// start is in the file.
+	std::vector<std::uint8_t> buffer;
+	std::size_t start;
+	std::uint64_t position;
+	// Left to skip of an element we don't care about
+	std::uint64_t skipping;
+
+	std::vector<Level> levels;
+	bool headerSeen;
+	std::uint64_t timecodeScale;
+	std::uint64_t clusterTimecode;
+
+	std::vector<StreamInfo> streams;
+	// Nanoseconds per tick of each stream's timecodes
+	std::vector<std::int64_t> timestampScales;
+	std::vector<float> trackTimecodeScales;
+	std::deque<std::pair<std::size_t, Packet>> queue;
+	std::vector<std::size_t> laceOffsets;
+
+	void parse();
+	void consume(std::size_t length);
+	void readElement(std::uint64_t id, const std::uint8_t *data, std::size_t size);
+	void readTracks(const std::uint8_t *data, std::size_t size);
+	void readBlock(const std::uint8_t *data, std::size_t size, bool isSimple, bool hasDuration, std::uint64_t duration, bool hasReference);
+	std::size_t findStream(std::uint64_t trackNumber) const;
+};
+
+} // matryona
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace matryona
+{
+
+// Counters of what the Parser and IOs do, to spot files that make us work
+// harder than they should. They cost an atomic add on the hot paths, so they
+// are only compiled in when building with MATRYONA_STATS (make STATS=1).
+// Otherwise counting compiles to nothing, and all counters read 0. Both
+// kinds of counter take the same space, so the classes holding them are laid
+// out the same either way, and the library and its users don't have to agree
+// on this.
+#ifdef MATRYONA_STATS
+const bool statsEnabled = true;
+#else
+const bool statsEnabled = false;
+#endif
+
+// A counter that can be added to from several threads at once
+template <bool enabled = statsEnabled>
+class Counter
+{
+public:
+	Counter()
+		: value(0)
+	{
+	}
+
+	Counter(const Counter &other)
+		: value(other.get())
+	{
+	}
+
+	Counter &operator=(const Counter &other)
+	{
+		value = other.get();
+		return *this;
+	}
+
+	void add(std::uint64_t amount = 1)
+	{
+		value.fetch_add(amount, std::memory_order_relaxed);
+	}
+
+	std::uint64_t get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> value;
+};
+
+// Keeps the space of a value, which it never touches
+template <>
+class Counter<false>
+{
+public:
+	Counter()
+	{
+	}
+
+	Counter(const Counter &)
+	{
+	}
+
+	Counter &operator=(const Counter &)
+	{
+		return *this;
+	}
+
+	void add(std::uint64_t = 1)
+	{
+	}
+
+	std::uint64_t get() const
+	{
+		return 0;
+	}
+
+private:
+	[[gnu::unused]] std::atomic<std::uint64_t> value;
+};
+
+static_assert(sizeof(Counter<true>) == sizeof(Counter<false>) && alignof(Counter<true>) == alignof(Counter<false>),
+		"Counters have to be laid out the same with and without MATRYONA_STATS");
+
+struct IOStats
+{
+	// Calls to read and readAt, and the bytes they returned
+	std::uint64_t reads;
+	std::uint64_t bytesRead;
+	std::uint64_t seeks;
+	// Element headers decoded from the IO, or from windows into it
+	std::uint64_t elementHeaders;
+};
+
+struct ParserStats
+{
+	// Block headers read, and how many of those blocks we passed over: blocks
+	// of other tracks when reading a stream on its own, of streams that are
+	// not selected, and of non-keyframes when reading keyframes
+	std::uint64_t blocks;
+	std::uint64_t blocksSkipped;
+	// Frames handed out, and their bytes
+	std::uint64_t frames;
+	std::uint64_t bytesDelivered;
+	// Stream buffers allocated, when a block didn't fit or Packets still
+	// used the old one
+	std::uint64_t bufferAllocations;
+};
+
+} // matryona
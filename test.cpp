@@ -40,8 +40,9 @@ int main(int argc, char **argv)
 	vpx_codec_dec_init(&context, vpx_codec_vp8_dx(), nullptr, 0);
 
 	uint8_t *buffer;
-	uint64_t size, timecode, duration;
-	p.readData(target, buffer, size, timecode, duration);
+	uint64_t size, duration;
+	int64_t timestamp;
+	p.readData(target, buffer, size, timestamp, duration);
 	vpx_codec_decode(&context, buffer, size, nullptr, 0);
 
 	vpx_codec_iter_t iter = nullptr;